@@ -0,0 +1,151 @@
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <stdint.h>
+#include <SFML/Audio/SoundStream.hpp>
+
+static constexpr int SAMPLERATE = 44100;
+
+// Sound timer on/off edges, timestamped in emulated cycles
+struct SoundEvent {
+	uint64_t cycle;
+	bool on;
+};
+
+// Single producer (emu thread), single consumer (audio thread) lock free queue of sound events,
+// plus how far emulation has gotten so the audio thread knows what it's allowed to play
+class SoundTimeline {
+public:
+	// Called from the emu thread whenever the sound timer starts or stops
+	void push(uint64_t cycle, bool on) {
+		state.store(on, std::memory_order_relaxed);
+
+		const auto currentTail = tail.load(std::memory_order_relaxed);
+		if (currentTail - head.load(std::memory_order_acquire) == events.size()) [[unlikely]] {
+			overflowed.store(true, std::memory_order_relaxed); // consumer resyncs from state instead
+			return;
+		}
+
+		events[currentTail & (events.size() - 1)] = { cycle, on };
+		tail.store(currentTail + 1, std::memory_order_release);
+	}
+
+	// Called from the emu thread at the end of every frame
+	void publish(uint64_t cycle, bool fastForwarding) {
+		fastForward.store(fastForwarding, std::memory_order_relaxed);
+		emuCycle.store(cycle, std::memory_order_release);
+	}
+
+	// Consumer side
+	bool peek(SoundEvent& event) {
+		const auto currentHead = head.load(std::memory_order_relaxed);
+		if (currentHead == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		event = events[currentHead & (events.size() - 1)];
+		return true;
+	}
+
+	void pop() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	std::atomic<uint64_t> emuCycle = 0;      // emulated cycles run so far
+	std::atomic<bool> fastForward = false;   // frame limiter is off
+	std::atomic<bool> state = false;         // latest sound timer state
+	std::atomic<bool> overflowed = false;
+
+private:
+	std::array<SoundEvent, 256> events;
+	std::atomic<uint64_t> head = 0;
+	std::atomic<uint64_t> tail = 0;
+};
+
+// Synthesizes the beeper on demand, following the sound timer edges in emulated time.
+// Playback trails emulation by a couple of frames so events are known before they're played,
+// and jumps forward if emulation pulls too far ahead.
+class ToneStream : public sf::SoundStream {
+public:
+	ToneStream(SoundTimeline& timeline, int cyclesPerSecond, bool muteFastForward) :
+		timeline(timeline), muteFastForward(muteFastForward) {
+		cyclesPerSample = (double)cyclesPerSecond / SAMPLERATE;
+		targetLag = cyclesPerSecond / 30.0; // 2 frames
+		maxLag = cyclesPerSecond / 10.0;    // 6 frames
+		initialize(1, SAMPLERATE);
+	}
+
+	~ToneStream() {
+		stop();
+	}
+
+private:
+	static constexpr int chunkSamples = 512; // ~11.6ms per chunk
+	static constexpr double amplitude = 30000; // how loud/quiet the sound is
+	static constexpr double frequency = 440;   // the pitch of the sound
+	static constexpr double twoPI = 6.283185307179586;
+	static constexpr double rampStep = 1.0 / (0.002 * SAMPLERATE); // 2ms attack/release so edges don't click
+
+	SoundTimeline& timeline;
+	bool muteFastForward;
+
+	std::array<int16_t, chunkSamples> samples;
+	double cyclesPerSample;
+	double targetLag;
+	double maxLag;
+
+	double cursor = 0; // emulated cycle the next sample is played at
+	double phase = 0;
+	double gain = 0;
+	bool on = false;
+
+	// Apply every event at or before cycle
+	void applyEvents(double cycle) {
+		SoundEvent event;
+		while (timeline.peek(event) && event.cycle <= cycle) {
+			on = event.on;
+			timeline.pop();
+		}
+	}
+
+	bool onGetData(Chunk& data) override {
+		const auto emuCycle = (double)timeline.emuCycle.load(std::memory_order_acquire);
+		const auto fastForward = timeline.fastForward.load(std::memory_order_relaxed);
+
+		if (timeline.overflowed.exchange(false, std::memory_order_relaxed)) [[unlikely]] {
+			applyEvents(emuCycle);
+			on = timeline.state.load(std::memory_order_relaxed);
+			cursor = emuCycle;
+		}
+
+		// Emulation ran too far ahead (fast forward, or we started late), skip to just behind it
+		if (fastForward || emuCycle - cursor > maxLag) {
+			cursor = std::max(cursor, emuCycle - (fastForward ? 0 : targetLag));
+			applyEvents(cursor);
+		}
+
+		const auto muted = fastForward && muteFastForward;
+		for (auto& sample : samples) {
+			// Don't run ahead of emulation, just hold the current state until it catches up
+			if (!fastForward && cursor + cyclesPerSample <= emuCycle) {
+				cursor += cyclesPerSample;
+				applyEvents(cursor);
+			}
+
+			const auto targetGain = (on && !muted) ? 1.0 : 0.0;
+			gain += std::clamp(targetGain - gain, -rampStep, rampStep);
+
+			sample = (int16_t)(amplitude * gain * sin(phase * twoPI));
+			phase += frequency / SAMPLERATE;
+			phase -= (int)phase;
+		}
+
+		data.samples = samples.data();
+		data.sampleCount = samples.size();
+		return true;
+	}
+
+	void onSeek(sf::Time timeOffset) override {}
+};
@@ -0,0 +1,225 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chip8.h>
+#include <config.h>
+#include <disassembler.h>
+#include <jitcommon.h>
+#include <chip8interpreter.h>
+#include <chip8cachedinterpreter.h>
+
+// Opcode micro-benchmarks (--bench <filter>). Each case is one instruction repeated to fill a page, then a jump back,
+// so every backend runs it as one block in a tight loop: the interpreter a handler call per instruction, the cached
+// interpreter a block of fallback calls, and the dynarec a block of lowered IR that links to itself. The AOT shares
+// the dynarec's lowering, so it isn't run separately, but the dynarec gets a column per SIMD level the host has.
+// Reports ns per instruction (the jump's share included, see the LD V0, V0 rows for what the loop alone costs) and
+// host bytes emitted for one copy of the instruction. DXYN is swept over every height, a few x offsets and both modes.
+// Dead write elimination is off, otherwise it would drop all but the last copy of pure ops and of flag computations
+class Benchmark {
+public:
+	using clock = std::chrono::steady_clock;
+
+	static constexpr uint16_t loopPC = 0x220;                 // page aligned, so the loop is exactly one block
+	static constexpr int copies = pageSize / 2 - 1;           // the jump back takes the last slot
+	static constexpr uint64_t timedCycles = 4 * 1024 * 1024;
+	static constexpr int runs = 5;                            // best of
+
+	struct Case {
+		std::string name;
+		uint16_t instr;
+		bool hires = false;
+		uint8_t x = 0; // V1, DXYN's x
+		uint8_t y = 0; // V2, DXYN's y
+	};
+
+	struct Column {
+		const char* name;
+		Backend backend;
+		SimdLevel simd;
+	};
+
+	struct Result {
+		double ns = 0;
+		int bytes = -1; // -1 if the backend doesn't emit code
+	};
+
+	// Process exit code, non zero if the filter matched nothing or a recompiler compiled the measured copy to nothing
+	static int run(const Config& config) {
+		const auto filter = strcmp(config.benchFilter, "all") ? config.benchFilter : "";
+		std::vector<Column> columns = {
+			{ "interpreter", Backend::Interpreter, SimdLevel::SSE2 },
+			{ "cachedinterpreter", Backend::CachedInterpreter, SimdLevel::SSE2 },
+		};
+		const Column dynarec[] = {
+			{ "dynarec sse2", Backend::Dynarec, SimdLevel::SSE2 },
+			{ "dynarec avx2", Backend::Dynarec, SimdLevel::AVX2 },
+			{ "dynarec avx512", Backend::Dynarec, SimdLevel::AVX512 },
+		};
+		for (const auto& column : dynarec) {
+			if (column.simd <= HostCpu::level(config.maxSimd)) {
+				columns.push_back(column);
+			}
+		}
+
+		printf("%-34s", "ns/instr, host bytes/instr");
+		for (const auto& column : columns) {
+			printf(" | %18s", column.name);
+		}
+		printf("\n");
+
+		auto matched = 0;
+		auto empty = 0;
+		for (const auto& benchCase : cases()) {
+			if (!strstr(benchCase.name.c_str(), filter)) {
+				continue;
+			}
+			matched++;
+
+			printf("%-34s", benchCase.name.c_str());
+			for (const auto& column : columns) {
+				const auto result = measure(config, benchCase, column);
+				if (result.bytes == 0) {
+					printf(" | %8.2f ns    0 B!", result.ns);
+					empty++;
+				} else if (result.bytes > 0) {
+					printf(" | %8.2f ns %4d B", result.ns, result.bytes);
+				} else {
+					printf(" | %8.2f ns       ", result.ns);
+				}
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+
+		if (!matched) {
+			printf("No benchmark matches %s\n", filter);
+			return 1;
+		}
+		if (empty) {
+			printf("%d measurements (marked !) emitted no code for the measured copy, so they timed something else\n", empty);
+			return 1;
+		}
+		return 0;
+	}
+
+private:
+	static std::vector<Case> cases() {
+		std::vector<Case> list;
+		const auto add = [&](uint16_t instr) {
+			list.push_back({ Chip8Disassembler::disassemble(instr), instr });
+		};
+
+		add(0x8000); // baseline
+		add(0x6123);
+		add(0x7123);
+		for (const auto op : { 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE }) {
+			add((uint16_t)(0x8120 | op));
+		}
+		add(0xA800);
+		add(0xC1FF);
+		add(0xF115);
+		add(0xF107);
+		add(0xF11E);
+		add(0xF129);
+		add(0xF133);
+		add(0xF355);
+		add(0xFF55);
+		add(0xF365);
+		add(0xFF65);
+		add(0x00E0);
+		add(0x00C4);
+		add(0x00FB);
+		add(0x00FC);
+
+		char name[64];
+		for (const auto hires : { false, true }) {
+			// Left edge, not byte aligned, straddling the left and right words (hires) or clipped at the edge (lores)
+			const int xs[] = { 0, 3, 60, hires ? 124 : 62 };
+			for (const auto x : xs) {
+				for (auto n = 0; n <= 15; n++) {
+					snprintf(name, sizeof(name), "DRW V1, V2, %-2d x=%-3d %s", n, x, hires ? "hires" : "lores");
+					list.push_back({ name, (uint16_t)(0xD120 | n), hires, (uint8_t)x, 0 });
+				}
+			}
+		}
+		return list;
+	}
+
+	// Setup, then the loop at loopPC
+	static std::vector<uint8_t> program(const Case& benchCase) {
+		std::vector<uint16_t> words;
+		if (benchCase.hires) {
+			words.push_back(0x00FF);
+		}
+		words.push_back(0xA000); // sprites come from the font, stores go nowhere near the code
+		words.push_back(0x6100 | benchCase.x);
+		words.push_back(0x6200 | benchCase.y);
+		words.push_back(0x1000 | loopPC);
+		words.resize((loopPC - 0x200) / 2, 0x8000);
+		words.insert(words.end(), copies, benchCase.instr);
+		words.push_back(0x1000 | loopPC);
+
+		std::vector<uint8_t> bytes;
+		for (const auto word : words) {
+			bytes.push_back(word >> 8);
+			bytes.push_back(word & 0xff);
+		}
+		return bytes;
+	}
+
+	static Result measure(const Config& config, const Case& benchCase, const Column& column) {
+		const auto backend = column.backend;
+		auto headless = config;
+		headless.romPath = nullptr;
+		headless.backend = Backend::Interpreter; // no recompiler until the program's in
+		headless.seed = 1;
+		headless.dumpCode = false;
+		headless.maxSimd = column.simd;
+		headless.eliminateDeadWrites = false; // every copy has to be compiled for the copies to be what's timed
+
+		auto core = std::make_unique<Chip8>(nullptr, headless);
+		const auto rom = program(benchCase);
+		core->loadProgram(rom.data(), rom.size());
+		core->initBackend(backend);
+
+		// Setup and the first trip round the loop compile everything, then the fastest of a few timed runs
+		runCycles(*core, 64);
+		Result result;
+		result.ns = 1e300;
+		for (auto i = 0; i < runs; i++) {
+			const auto start = clock::now();
+			const auto cycles = runCycles(*core, timedCycles);
+			const auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+			result.ns = std::min(result.ns, elapsed / cycles);
+		}
+
+		const std::vector<BlockInfo>* blocks = nullptr;
+		if (backend == Backend::CachedInterpreter) {
+			blocks = &core->cachedInterpreter->blockInfo;
+		} else if (core->jit) {
+			blocks = &core->jit->blockInfo;
+		}
+		if (blocks) {
+			for (const auto& info : *blocks) {
+				if (info.startPC == loopPC && info.guestOffsets.size() > 2) { // the second copy, the first loads registers
+					result.bytes = (int)(info.guestOffsets[2] - info.guestOffsets[1]);
+				}
+			}
+		}
+		return result;
+	}
+
+	static uint64_t runCycles(Chip8& core, uint64_t cycles) {
+		uint64_t ran = 0;
+		while (ran < cycles) {
+			ran += core.cpuExecuteFunc(core, (int)std::min<uint64_t>(cycles - ran, 1 << 20));
+		}
+		return ran;
+	}
+};
@@ -1,48 +1,94 @@
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <chrono>
 #include <condition_variable>
 #include <fstream>
+#include <random>
 #include <gui.h>
+#include <framepacer.h>
+#include <perfmap.h>
 #include <chip8.h>
 #include <chip8interpreter.h>
 #include <chip8cachedinterpreter.h>
 #include <chip8dynarec.h>
 #include <chip8aot.h>
+#include <codecachedump.h>
+#include <savestate.h>
+#include <replay.h>
 
-Chip8::Chip8(GUI* gui, int speed) {
+Chip8::Chip8(GUI* gui, const Config& config) {
 	this->gui = gui;
-	this->speed = speed;
+	this->config = config;
+	this->speed = config.speed;
+	profiler.enabled = config.profileBlocks;
+	profiler.countCycles = config.profileCycles;
+	PerfMap::enable(config.perfMap, config.jitdump);
 
 	pc = 0x200;
 	ram.fill(0);
 	stack.fill(0);
 	gpr.fill(0);
-	keyState.fill(0);
 	display.fill(0);
 
-	//loadRom("../../roms/testroms/test_opcode.ch8");
-	loadRom("../../roms/invaders");
+	seed = config.seed ? config.seed : std::random_device{}() | 1; // xorshift never leaves 0
+	rng = seed;
+
+	loadRom(config.romPath);
 	loadFonts();
+	initBackend(config.backend);
+
+	if (config.recordPath) {
+		recording = std::make_unique<InputLog>();
+		recording->seed = seed;
+		recording->speed = speed;
+	}
 };
 
 Chip8::~Chip8() {
-	dumpCodeCache();
-
-	//maaaybe i should've made the code emitters and page tables global...
-	for (auto& i : Chip8CachedInterpreter::blockPageTable) {
-		delete[] i;
+	if (config.dumpCode) {
+		dumpCodeCache();
+	}
+	if (profiler.enabled) {
+		profiler.dumpReport("hotspots.txt");
 	}
+}
 
-	for (auto& i : Chip8Dynarec::blockPageTable) {
-		delete[] i;
+void Chip8::initBackend(Backend backend) {
+	switch (backend) {
+	case Backend::Interpreter:
+		cpuExecuteFunc = Chip8Interpreter::executeFunc;
+		break;
+	case Backend::CachedInterpreter:
+		cachedInterpreter = std::make_unique<CachedInterpreterContext>();
+		cpuExecuteFunc = Chip8CachedInterpreter::executeFunc;
+		break;
+	case Backend::Dynarec:
+		jit = Chip8Dynarec::createContext(*this);
+		cpuExecuteFunc = Chip8Dynarec::executeFunc;
+		break;
+	case Backend::AOT:
+		jit = Chip8AOT::createContext(*this);
+		cpuExecuteFunc = Chip8AOT::executeFunc;
+		Chip8AOT::recompileAllBlocks(*this);
+		if (gui) { // headless runs like the fuzzer make a core per program
+			printf("Finished AOT recompiling all blocks!\n");
+		}
+		break;
 	}
 
-	for (auto& i : Chip8AOT::blockPageTable) {
-		delete[] i;
+	if (gui && (backend == Backend::Dynarec || backend == Backend::AOT)) {
+		printf("Recompiling with %s\n", simdName(HostCpu::level(config.maxSimd)));
 	}
 }
 
+uint8_t Chip8::randomByte() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng >> 24;
+}
+
 void Chip8::waitForPing() {
 	std::unique_lock<std::mutex> lock(gui->mRunFrame);
 	gui->cvRunFrame.wait(lock, [this] {
@@ -57,20 +103,32 @@ void Chip8::pingGuiThread() {
 	gui->cvRunFrame.notify_one();
 }
 
-void Chip8::loadRom(const char* path) { //TODO: throw error if file not found
+void Chip8::loadRom(const char* path) {
+	if (!path) { // the fuzzer hands its programs over with loadProgram
+		return;
+	}
+
 	std::ifstream file(path, std::ios::binary);
-	file.read((char*)(ram.data() + 0x200), sizeof(uint8_t) * 4096 - 0x200);
+	if (!file) {
+		printf("Couldn't open rom %s\n", path);
+	}
+	file.read((char*)(ram.data() + 0x200), sizeof(uint8_t) * RAM_SIZE - 0x200);
+	romSize = file.gcount();
+}
+
+void Chip8::loadProgram(const uint8_t* program, size_t size) {
+	size = std::min(size, (size_t)RAM_SIZE - 0x200);
+	memcpy(ram.data() + 0x200, program, size);
+	romSize = size;
 }
 
 template <typename T>
 auto Chip8::read(uint16_t addr) -> T {
 	if constexpr (std::is_same<T, uint8_t>::value) {
-		assert(addr <= 0xfff);
 		return ram[addr];
 	}
 	else if (std::is_same<T, uint16_t>::value) {
-		assert(addr < 0xfff);
-		return ((uint16_t)ram[addr] << 8) | (uint16_t)ram[(addr + 1)];
+		return ((uint16_t)ram[addr] << 8) | (uint16_t)ram[(uint16_t)(addr + 1)]; // wraps at the top of ram
 	}
 }
 
@@ -97,55 +155,242 @@ void Chip8::loadFonts() {
 	memcpy(ram.data(), fonts.data(), fonts.size());
 }
 
+void Chip8::saveState(SaveState& state) const {
+	memcpy(state.ram.data(), ram.data(), RAM_SIZE);
+	state.stack = stack;
+	state.gpr = gpr;
+	state.display = display;
+	state.pc = pc;
+	state.index = index;
+	state.sp = sp;
+	state.delay = delay;
+	state.sound = sound;
+	state.hires = hires;
+	state.planes = planes;
+	state.rng = rng;
+}
+
+void Chip8::loadState(const SaveState& state) {
+	invalidateChangedCode(state);
+	memcpy(ram.data(), state.ram.data(), RAM_SIZE);
+	stack = state.stack;
+	gpr = state.gpr;
+	display = state.display;
+	pc = state.pc;
+	index = state.index;
+	sp = state.sp;
+	delay = state.delay;
+	sound = state.sound;
+	hires = state.hires;
+	planes = state.planes;
+	rng = state.rng;
+}
+
+// Recompiled code is only thrown out for pages the state actually changes, so loading a state (or rewinding,
+// which loads one every frame) mostly keeps the code cache warm
+void Chip8::invalidateChangedCode(const SaveState& state) {
+	for (auto page = 0; page < RAM_SIZE; page += pageSize) {
+		if (memcmp(ram.data() + page, state.ram.data() + page, pageSize) == 0) {
+			continue;
+		}
+
+		JitStats::bump(stats.stateInvalidations);
+		if (cachedInterpreter) {
+			Chip8CachedInterpreter::invalidateRange(cachedInterpreter.get(), page, page + pageSize - 1);
+		}
+		if (jit) {
+			X64Lowering::invalidateRange(jit.get(), page, pageSize);
+		}
+	}
+}
+
+// Quick save slot, F5 saves and F8 loads
+void Chip8::handleStateRequest() {
+	switch (stateRequest.exchange(StateRequest::None, std::memory_order_relaxed)) {
+	case StateRequest::Save:
+		if (!quickSave) {
+			quickSave = std::make_unique<SaveState>();
+		}
+		saveState(*quickSave);
+		printf("Saved state\n");
+		break;
+	case StateRequest::Load:
+		if (quickSave) {
+			loadState(*quickSave);
+			printf("Loaded state\n");
+			if (recording) {
+				printf("The input log won't replay past this frame\n");
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
 void Chip8::dumpCodeCache() {
-	//TODO: only dump if recompiling
-	std::ofstream file("emittedcode.bin", std::ios::binary);
-	file.write((const char*)Chip8Dynarec::code.getCode(), Chip8Dynarec::code.getSize());
+	// Backends that didn't recompile anything are skipped
+	if (cachedInterpreter) {
+		CodeCacheDump::dump("cachedinterpreter", cachedInterpreter->code, cachedInterpreter->blockInfo);
+	}
+	if (jit) {
+		CodeCacheDump::dump(jit->name, jit->code, jit->blockInfo);
+	}
+}
+
+// Timers tick once per emulated frame, so they stay in step with emulation at any speed.
+// Frames run ahead aren't audible, the sound comes from the real ones
+void Chip8::tickTimers(bool audible) {
+	if (delay) --delay;
+	if (sound) --sound;
+	if (audible) {
+		updateSound(totalCycles);
+	}
+}
+
+void Chip8::presentFrame() {
+	std::lock_guard<std::mutex> lock(presentLock);
+	presentedDisplay = display;
+	presentedHires = hires;
+}
+
+// Send an event to the audio thread if the sound timer started or stopped
+void Chip8::updateSound(uint64_t cycle) {
+	if ((sound != 0) != soundOn) [[unlikely]] {
+		soundOn ^= true;
+		soundTimeline.push(cycle, soundOn);
+	}
+}
+
+// Execute a frame's worth of instructions, at least cycles of them as recompiled blocks can run a little over.
+// Frames that aren't audible (run ahead, or headless) stay off the sound timeline
+int Chip8::emulateFrame(int cycles, bool audible, int& dispatches) {
+	auto cyclesRan = 0;
+	while (cyclesRan < cycles) {
+		cyclesRan += cpuExecuteFunc(*this, cycles - cyclesRan);
+		++dispatches;
+		if (audible) {
+			updateSound(totalCycles + cyclesRan); // catch Fx18 to within a block
+		}
+	}
+	tickTimers(audible);
+	return cyclesRan;
 }
 
 void Chip8::runFrame() {
 	sf::Clock deltaClock;
 	sf::Time elapsedTime;
-	sf::Time frameTime;
 	int fps = 0;
 
-	//TODO: move this to ctor
-	static auto cpuExecuteFunc = Chip8Dynarec::executeFunc;
-	if (cpuExecuteFunc == Chip8AOT::executeFunc) {
-		Chip8AOT::recompileAllBlocks(*this);
-		printf("Finished AOT recompiling all blocks!\n");
+	FramePacer pacer(config.targetRate);
+	auto wasFrameLimited = gui->isFrameLimited;
+
+	if (config.emuThreadCpu >= 0 && !FramePacer::pinCurrentThread(config.emuThreadCpu)) {
+		printf("Couldn't pin emu thread to cpu %d\n", config.emuThreadCpu);
+	}
+
+	std::unique_ptr<StatsReporter> statsReporter;
+	if (config.statsInterval > 0) {
+		statsReporter = std::make_unique<StatsReporter>(stats, config.statsInterval, config.statsPath);
+	}
+
+	std::unique_ptr<RewindBuffer> rewind;
+	auto frameState = std::make_unique<SaveState>();
+	if (config.rewindSeconds > 0) {
+		rewind = std::make_unique<RewindBuffer>((size_t)(config.rewindSeconds * 60));
 	}
 
 	while (gui->window.isOpen()) {
 		//waitForPing();
 
-		//execute one frame's worth of instuctions
+		handleStateRequest();
+
+		//run a frame, or step back one while rewinding
 		auto cyclesRan = 0;
-		while (cyclesRan < (speed / 60)) {
-			cyclesRan += cpuExecuteFunc(*this);
+		auto dispatches = 0;
+		if (rewind && rewinding.load(std::memory_order_relaxed) && rewind->stepBack(*frameState)) {
+			loadState(*frameState);
+			updateSound(totalCycles);
+			presentFrame();
+			if (recording && !recording->frames.empty()) { // so the log still replays
+				recording->frames.pop_back();
+			}
 		}
+		else {
+			if (recording) {
+				recording->frames.push_back(keyState.load(std::memory_order_relaxed));
+			}
+			cyclesRan = emulateFrame(speed / 60, true, dispatches);
+			totalCycles += cyclesRan;
+
+			if (rewind) {
+				saveState(*frameState);
+				rewind->push(*frameState);
+			}
+
+			//Run-ahead: show the frame config.runAhead frames from now, as if the current input had been held since
+			//this frame, then roll back. Games see input a frame or more after it changes, so this hides that.
+			//The real frames stay in charge of sound, and the sound timeline never sees the speculative ones
+			if (config.runAhead > 0) {
+				if (!rewind) { // otherwise it's already there
+					saveState(*frameState);
+				}
+				auto speculativeDispatches = 0;
+				for (auto i = 0; i < config.runAhead; i++) {
+					emulateFrame(speed / 60, false, speculativeDispatches);
+				}
+				presentFrame();
+				loadState(*frameState);
+			}
+			else {
+				presentFrame();
+			}
+		}
+		soundTimeline.publish(totalCycles, !gui->isFrameLimited);
+
+		JitStats::bump(stats.instructionsRetired, cyclesRan);
+		JitStats::bump(stats.blocksDispatched, dispatches);
+		JitStats::bump(stats.frames);
+		JitStats::set(stats.cyclesLastFrame, cyclesRan);
+		if (statsReporter) {
+			statsReporter->update();
+		}
+
+		//Software framelimiter
+		//Sleeps most of the way to an absolute deadline and spins the rest, so it doesn't drift
+		if (gui->isFrameLimited) {
+			if (!wasFrameLimited) [[unlikely]] { // don't try to catch up on the frames we ran unlimited
+				pacer.reset();
+			}
+			pacer.wait();
+		}
+		wasFrameLimited = gui->isFrameLimited;
+		pacer.recordFrame();
 
 		//Calulate fps
-		frameTime = deltaClock.restart();
-		elapsedTime += frameTime;
+		elapsedTime += deltaClock.restart();
 		if (elapsedTime.asSeconds() >= 1) [[unlikely]] {
 			gui->window.setTitle("JIT8 | FPS: " + std::to_string(fps));
+
+			const auto jitter = pacer.report();
+			if (config.reportJitter) {
+				printf("Frame time (ms) | p50: %.3f p90: %.3f p99: %.3f max: %.3f over %zu frames\n",
+					jitter.p50, jitter.p90, jitter.p99, jitter.max, jitter.frames);
+				if (rewind) {
+					printf("Rewind | %zu frames in %.1f KB\n", rewind->frames(), rewind->sizeBytes() / 1024.0);
+				}
+			}
+
 			fps = 0;
 			elapsedTime = sf::Time::Zero;
 		}
 
-		//Software framelimiter
-		//Literally costs around 1-1.5 million fps to have this :(
-		//Comment out for max speed
-		if (gui->isFrameLimited) {
-			sf::sleep(sf::milliseconds(17) - frameTime);
-			elapsedTime += deltaClock.restart(); // restart deltaclock so next frame isn't affected
-		}
-
 		++fps;
 
 		//pingGuiThread();
 	}
 
-	return;
+	if (recording && recording->save(config.recordPath)) {
+		printf("Recorded %zu frames to %s\n", recording->frames.size(), config.recordPath);
+	}
 }
\ No newline at end of file
@@ -1,25 +1,47 @@
 #pragma once
 #include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <thread>
 #include <stdint.h>
 #include <gui.h>
+#include <config.h>
+#include <audio.h>
+#include <profiler.h>
+#include <stats.h>
 
 class GUI;
+struct JitContext;
+struct CachedInterpreterContext;
+struct SaveState;
+struct InputLog;
+enum class StateRequest : uint8_t;
 
 static constexpr int WIDTH = 64;
 static constexpr int HEIGHT = 32;
+static constexpr int HIRES_WIDTH = 128; //SCHIP
+static constexpr int HIRES_HEIGHT = 64;
+static constexpr int DISPLAY_GUARD = 16; //rows below the screen, so recompiled DXYN never has to clip addresses
+static constexpr int DISPLAY_PLANES = 2; //XO-CHIP
+static constexpr int PLANE_WORDS = (HIRES_HEIGHT + DISPLAY_GUARD) * 2;
+
+static constexpr int RAM_SIZE = 0x10000; //XO-CHIP, everything else only uses the first 4K
+static constexpr int RAM_GUARD = 64; //past the end of ram. Sprites, register ranges and BCD at the very top run on into it on every backend, none wrap
 
 class Chip8 {
 private:
 	GUI* gui;
 
 	//Config
+	Config config;
 	int speed; //how many cycles executed in a second
 
 	//Memory
-	std::array<uint8_t, 4096> ram;
+	std::array<uint8_t, RAM_SIZE + RAM_GUARD> ram;
 	std::array<uint16_t, 16> stack;
+	size_t romSize = 0;
 
 	//Registers
 	uint16_t pc = 0; //program counter
@@ -32,20 +54,78 @@ public:
 	friend class Chip8CachedInterpreter;
 	friend class Chip8Dynarec;
 	friend class Chip8AOT;
+	friend class IRDecoder;
+	friend class X64Lowering;
+	friend class Replay;
+	friend class Conformance;
+	friend class Fuzzer;
 
 	uint8_t delay = 0; //delay timer
 	uint8_t sound = 0; //sound timer
 
-	alignas(32) std::array<uint64_t, HEIGHT> display;
-	std::array<bool, 16> keyState; //input
+	//Cxkk's random numbers come from a xorshift32 owned by the core rather than rand(), so a seed (and a save state)
+	//pins them down for every backend
+	uint32_t seed = 0;
+	uint32_t rng = 0;
+
+	//Backend, runs a block (or a single instruction) and returns cycles taken
+	using executefp = int(*)(Chip8& core, int cycleBudget);
+	executefp cpuExecuteFunc = nullptr;
+
+	//Audio
+	uint64_t totalCycles = 0; //cycles emulated since boot, timestamps sound events
+	bool soundOn = false;
+	SoundTimeline soundTimeline;
+
+	//Code cache and block tables of the dynarec or AOT, whichever this core runs on, and of the cached interpreter.
+	//Per core, so instances don't share (or flush) each other's code
+	std::unique_ptr<JitContext> jit;
+	std::unique_ptr<CachedInterpreterContext> cachedInterpreter;
+
+	//Save states (see savestate.h). Requests come from the GUI thread and get handled between frames
+	std::atomic<StateRequest> stateRequest{};
+	std::atomic<bool> rewinding = false; //steps back a frame per frame while set
+	std::unique_ptr<SaveState> quickSave;
+	std::unique_ptr<InputLog> recording; //--record, saved when the emu thread stops
+
+	//Instrumentation
+	BlockProfiler profiler;
+	JitStats stats;
+
+	//A plane after the other, PLANE_WORDS apart. Rows are 128 pixels, split in a left and right word with the leftmost
+	//pixel in the top bit. Lores only uses the left words of the first 32 rows, everything else stays clear,
+	//as do the guard rows
+	alignas(32) std::array<uint64_t, PLANE_WORDS * DISPLAY_PLANES> display;
+	uint8_t hires = 0; //SCHIP 128x64 mode, read as a byte by recompiled code
+	uint8_t planes = 1; //XO-CHIP planes drawn to, bit n selects plane n
+
+	//The display as of the last finished frame, which is what the GUI draws. With run-ahead it's a few frames
+	//ahead of display, which gets rolled back
+	std::mutex presentLock;
+	std::array<uint64_t, PLANE_WORDS * DISPLAY_PLANES> presentedDisplay = {};
+	uint8_t presentedHires = 0;
+	std::atomic<uint16_t> keyState = 0; //input, bit n is set while key n is held
+	static_assert(sizeof(std::atomic<uint16_t>) == sizeof(uint16_t) && std::atomic<uint16_t>::is_always_lock_free,
+		"recompiled code reads keyState as a plain word");
 
-	Chip8(GUI* gui, int speed);
+	Chip8(GUI* gui, const Config& config);
 	~Chip8();
 	void waitForPing();
 	void pingGuiThread();
 	void runFrame();
+	void initBackend(Backend backend);
+	int emulateFrame(int cycles, bool audible, int& dispatches);
+	uint8_t randomByte();
+	void tickTimers(bool audible = true);
+	void updateSound(uint64_t cycle);
 	void loadRom(const char* path);
+	void loadProgram(const uint8_t* program, size_t size);
 	void loadFonts();
+	void saveState(SaveState& state) const;
+	void loadState(const SaveState& state);
+	void handleStateRequest();
+	void invalidateChangedCode(const SaveState& state);
+	void presentFrame();
 
 	//Utility stuff
 	template <typename T>
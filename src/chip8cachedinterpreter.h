@@ -1,31 +1,45 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
 #include <stdio.h>
 #include <chip8.h>
 #include <jitcommon.h>
 
 class Chip8;
 
+// Code cache and block tables of one core. Blocks have the core they were compiled for baked in, so every core
+// gets its own
+struct CachedInterpreterContext {
+	x64Emitter code;
+	std::array<std::unique_ptr<fp[]>, (RAM_SIZE >> pageShift)> blockPageTable; // pages allocated on first use
+	std::vector<BlockInfo> blockInfo; // for annotated code cache dumps
+};
+
 class Chip8CachedInterpreter {
 public:
-	inline static fp* blockPageTable[4096 >> pageShift]; //TODO: array of unique ptrs?
-	inline static x64Emitter code;
+	// A fallback call and an invalidate for each of a page's instructions, plus the prologue and epilogue
+	static constexpr size_t maxBlockBytes = pageSize / 2 * 64 + 128;
 
 	// Get offset from a variable to the cpu core
 	static uintptr_t constexpr inline getOffset(Chip8& core, void* variable) {
 		return (uintptr_t)variable - (uintptr_t)&core;
 	}
 
-	static int executeFunc(Chip8& core) {
+	static int executeFunc(Chip8& core, int cycleBudget) { // always runs a single block
 		//printf("%04X\n", core.pc);
 
-		auto& page = blockPageTable[core.pc >> pageShift];
+		auto& ctx = *core.cachedInterpreter;
+		auto& page = ctx.blockPageTable[core.pc >> pageShift];
 		if (!page) {  // if page hasn't been allocated yet, allocate
-			page = new fp[pageSize](); //blocks could be half the size, but I'm not sure about alignment
+			page = std::make_unique<fp[]>(pageSize); //blocks could be half the size, but I'm not sure about alignment
 		}
 
 		auto& block = page[core.pc & (pageSize - 1)];
 		if (!block) { // if recompiled block doesn't exist, recompile
-			block = recompileBlock(core);
+			JitStats::bump(core.stats.dispatcherMisses);
+			block = recompileBlock(ctx, core);
 		}
 
 		auto cyclesTakenByBlock = (*block)(); //each block returns cycles taken in eax
@@ -33,68 +47,95 @@ public:
 		return cyclesTakenByBlock;
 	}
 
-	static fp recompileBlock(Chip8& core) {
-		checkCodeCache();
-		auto emittedCode = (fp)code.getCurr();
+	static fp recompileBlock(CachedInterpreterContext& ctx, Chip8& core) {
+		CompileTimer timer(core.stats);
+		checkCodeCache(ctx, core);
+		auto& code = ctx.code;
+		auto emittedCode = (fp)code.rx(code.getCurr());
+		BlockInfo info(code, core.pc);
 		auto cycles = 0;
 		auto dynarecPC = core.pc;
 
 		// Function prologue
 		code.push(rbp);
 		code.mov(rbp, (uintptr_t)&core); //Load cpu state
-		code.sub(rsp, 40); //permanently align stack for all function calls in block
+		code.sub(rsp, 32); //shadow space, and realigns the stack to 16 for all function calls in block after the push
 		auto addPCPointer = code.getSize(); //get pointer to cache position to overwrite later
 		code.add(word[rbp + getOffset(core, &core.pc)], 0);
 
 		while (true) {
 			auto instr = core.read<uint16_t>(dynarecPC);
+			info.beginInstr(code, instr);
 			dynarecPC += 2;
 			auto jumpOccured = false;
 
 			switch (((instr) & 0xf000) >> 12) {
 			case 0x0:
 				switch (instr & 0xfff) {
-				case 0x0E0: emitFallback(Chip8Interpreter::CLS, core, instr);                    break;
-				case 0x0EE: emitFallback(Chip8Interpreter::RET, core, instr); jumpOccured = true; break;
+				case 0x0E0: emitFallback(code, Chip8Interpreter::CLS, core, instr);                    break;
+				case 0x0EE: emitFallback(code, Chip8Interpreter::RET, core, instr); jumpOccured = true; break;
+				case 0x0FB: emitFallback(code, Chip8Interpreter::SCR, core, instr);                    break;
+				case 0x0FC: emitFallback(code, Chip8Interpreter::SCL, core, instr);                    break;
+				case 0x0FE: emitFallback(code, Chip8Interpreter::LOW, core, instr);                    break;
+				case 0x0FF: emitFallback(code, Chip8Interpreter::HIGH, core, instr);                   break;
+				default:
+					if ((instr & 0xff0) == 0x0C0) {
+						emitFallback(code, Chip8Interpreter::SCD, core, instr);
+						break;
+					}
+					printf("Unimplemented Instruction - %04X\n", instr);
+					//exit(1);
+				}
+
+				break;
+			case 0x1: emitFallback(code, Chip8Interpreter::JP, core, instr);        jumpOccured = true; break;
+			case 0x2: emitFallback(code, Chip8Interpreter::CALL, core, instr);      jumpOccured = true; break;
+			case 0x3: emitFallback(code, Chip8Interpreter::SEVxByte, core, instr);  jumpOccured = true; break;
+			case 0x4: emitFallback(code, Chip8Interpreter::SNEVxByte, core, instr); jumpOccured = true; break;
+			case 0x5:
+				switch (instr & 0xf) {
+				case 0x0: emitFallback(code, Chip8Interpreter::SEVxVy, core, instr); jumpOccured = true; break;
+				case 0x2: {
+					emitFallback(code, Chip8Interpreter::SAVEVxVy, core, instr);
+					const auto x = (instr & 0x0f00) >> 8, y = (instr & 0x00f0) >> 4;
+					emitInvalidate(ctx, core, x > y ? x - y : y - x);
+					break;
+				}
+				case 0x3: emitFallback(code, Chip8Interpreter::LOADVxVy, core, instr); break;
 				default:
 					printf("Unimplemented Instruction - %04X\n", instr);
 					//exit(1);
 				}
 
 				break;
-			case 0x1: emitFallback(Chip8Interpreter::JP, core, instr);        jumpOccured = true; break;
-			case 0x2: emitFallback(Chip8Interpreter::CALL, core, instr);      jumpOccured = true; break;
-			case 0x3: emitFallback(Chip8Interpreter::SEVxByte, core, instr);  jumpOccured = true; break;
-			case 0x4: emitFallback(Chip8Interpreter::SNEVxByte, core, instr); jumpOccured = true; break;
-			case 0x5: emitFallback(Chip8Interpreter::SEVxVy, core, instr);    jumpOccured = true; break;
-			case 0x6: emitFallback(Chip8Interpreter::LDVxByte, core, instr);                     break;
-			case 0x7: emitFallback(Chip8Interpreter::ADDVxByte, core, instr);                    break;
+			case 0x6: emitFallback(code, Chip8Interpreter::LDVxByte, core, instr);                     break;
+			case 0x7: emitFallback(code, Chip8Interpreter::ADDVxByte, core, instr);                    break;
 			case 0x8:
 				switch (instr & 0xf) {
-				case 0x0: emitFallback(Chip8Interpreter::LDVxVy, core, instr);   break;
-				case 0x1: emitFallback(Chip8Interpreter::ORVxVy, core, instr);   break;
-				case 0x2: emitFallback(Chip8Interpreter::ANDVxVy, core, instr);  break;
-				case 0x3: emitFallback(Chip8Interpreter::XORVxVy, core, instr);  break;
-				case 0x4: emitFallback(Chip8Interpreter::ADDVxVy, core, instr);  break;
-				case 0x5: emitFallback(Chip8Interpreter::SUBVxVy, core, instr);  break;
-				case 0x6: emitFallback(Chip8Interpreter::SHRVxVy, core, instr);  break;
-				case 0x7: emitFallback(Chip8Interpreter::SUBNVxVy, core, instr); break;
-				case 0xE: emitFallback(Chip8Interpreter::SHLVxVy, core, instr);  break;
+				case 0x0: emitFallback(code, Chip8Interpreter::LDVxVy, core, instr);   break;
+				case 0x1: emitFallback(code, Chip8Interpreter::ORVxVy, core, instr);   break;
+				case 0x2: emitFallback(code, Chip8Interpreter::ANDVxVy, core, instr);  break;
+				case 0x3: emitFallback(code, Chip8Interpreter::XORVxVy, core, instr);  break;
+				case 0x4: emitFallback(code, Chip8Interpreter::ADDVxVy, core, instr);  break;
+				case 0x5: emitFallback(code, Chip8Interpreter::SUBVxVy, core, instr);  break;
+				case 0x6: emitFallback(code, Chip8Interpreter::SHRVxVy, core, instr);  break;
+				case 0x7: emitFallback(code, Chip8Interpreter::SUBNVxVy, core, instr); break;
+				case 0xE: emitFallback(code, Chip8Interpreter::SHLVxVy, core, instr);  break;
 				default:
 					printf("Unimplemented Instruction - %04X\n", instr);
 					//exit(1);
 				}
 
 				break;
-			case 0x9: emitFallback(Chip8Interpreter::SNEVxVy, core, instr); jumpOccured = true; break;
-			case 0xA: emitFallback(Chip8Interpreter::LDI, core, instr);                        break;
-			case 0xB: emitFallback(Chip8Interpreter::JPV0, core, instr);    jumpOccured = true; break;
-			case 0xC: emitFallback(Chip8Interpreter::RNDVxByte, core, instr); break;
-			case 0xD: emitFallback(Chip8Interpreter::DXYN, core, instr);                       break;
+			case 0x9: emitFallback(code, Chip8Interpreter::SNEVxVy, core, instr); jumpOccured = true; break;
+			case 0xA: emitFallback(code, Chip8Interpreter::LDI, core, instr);                        break;
+			case 0xB: emitFallback(code, Chip8Interpreter::JPV0, core, instr);    jumpOccured = true; break;
+			case 0xC: emitFallback(code, Chip8Interpreter::RNDVxByte, core, instr); break;
+			case 0xD: emitFallback(code, Chip8Interpreter::DXYN, core, instr);                       break;
 			case 0xE:
 				switch (instr & 0xff) {
-				case 0x9E: emitFallback(Chip8Interpreter::SKPVx, core, instr);  jumpOccured = true; break;
-				case 0xA1: emitFallback(Chip8Interpreter::SKNPVx, core, instr); jumpOccured = true; break;
+				case 0x9E: emitFallback(code, Chip8Interpreter::SKPVx, core, instr);  jumpOccured = true; break;
+				case 0xA1: emitFallback(code, Chip8Interpreter::SKNPVx, core, instr); jumpOccured = true; break;
 				default:
 					printf("Unimplemented Instruction - %04X\n", instr);
 					//exit(1);
@@ -103,30 +144,31 @@ public:
 				break;
 			case 0xF:
 				switch (instr & 0xff) {
-				case 0x07: emitFallback(Chip8Interpreter::LDVxDT, core, instr);                   break;
-				case 0x0A: emitFallback(Chip8Interpreter::LDVxK, core, instr); jumpOccured = true; break;
-				case 0x15: emitFallback(Chip8Interpreter::LDDTVx, core, instr);                   break;
-				case 0x18: emitFallback(Chip8Interpreter::LDSTVx, core, instr);                   break;
-				case 0x1E: emitFallback(Chip8Interpreter::ADDIVx, core, instr);                   break;
-				case 0x29: emitFallback(Chip8Interpreter::LDFVx, core, instr);                    break;
+				case 0x00:
+					if (instr == 0xF000) { // the address is right there, so no need for a fallback
+						info.addLongOperand(core.read<uint16_t>(dynarecPC));
+						code.mov(word[rbp + getOffset(core, &core.index)], info.longOperands.back());
+						dynarecPC += 2;
+						break;
+					}
+					printf("Unimplemented Instruction - %04X\n", instr);
+					break;
+				case 0x01: emitFallback(code, Chip8Interpreter::PLANE, core, instr);                    break;
+				case 0x07: emitFallback(code, Chip8Interpreter::LDVxDT, core, instr);                   break;
+				case 0x0A: emitFallback(code, Chip8Interpreter::LDVxK, core, instr); jumpOccured = true; break;
+				case 0x15: emitFallback(code, Chip8Interpreter::LDDTVx, core, instr);                   break;
+				case 0x18: emitFallback(code, Chip8Interpreter::LDSTVx, core, instr);                   break;
+				case 0x1E: emitFallback(code, Chip8Interpreter::ADDIVx, core, instr);                   break;
+				case 0x29: emitFallback(code, Chip8Interpreter::LDFVx, core, instr);                    break;
 				case 0x33:
-					emitFallback(Chip8Interpreter::LDBVx, core, instr);
-					code.mov(rax, (uintptr_t)Chip8CachedInterpreter::invalidateRange);
-					code.mov(ecx, word[rbp + getOffset(core, &core.index)]);
-					code.mov(edx, word[rbp + getOffset(core, &core.index)]);
-					code.add(edx, 2);
-					code.call(rax);
+					emitFallback(code, Chip8Interpreter::LDBVx, core, instr);
+					emitInvalidate(ctx, core, 2);
 					break;
-				case 0x55: {
-					emitFallback(Chip8Interpreter::LDIVx, core, instr);
-					code.mov(rax, (uintptr_t)Chip8CachedInterpreter::invalidateRange);
-					code.mov(ecx, word[rbp + getOffset(core, &core.index)]);
-					code.mov(edx, word[rbp + getOffset(core, &core.index)]);
-					code.add(edx, ((instr & 0x0f00) >> 8));
-					code.call(rax);
+				case 0x55:
+					emitFallback(code, Chip8Interpreter::LDIVx, core, instr);
+					emitInvalidate(ctx, core, (instr & 0x0f00) >> 8);
 					break;
-				}
-				case 0x65: emitFallback(Chip8Interpreter::LDVxI, core, instr); break;
+				case 0x65: emitFallback(code, Chip8Interpreter::LDVxI, core, instr); break;
 				default:
 					printf("Unimplemented Instruction - %04X\n", instr);
 					//exit(1);
@@ -139,49 +181,80 @@ public:
 			}
 
 			++cycles;
-			if ((dynarecPC & (pageSize - 1)) == 0 || jumpOccured) { //If we exceed the page boundary, dip
+			if ((dynarecPC >> pageShift) != (core.pc >> pageShift) || jumpOccured) { //If we exceed the page boundary, dip
 				break;
 			}
 		}
 
 		//Function epilogue
+		info.beginEpilogue(code);
 
-		// Set cycles taken by block retroactively in prologue
+		// Set bytes taken by block retroactively in prologue, F000 is 4 bytes so it's not just cycles * 2
 		auto returnPointer = code.getSize();
 		code.setSize(addPCPointer);
-		code.add(word[rbp + getOffset(core, &core.pc)], cycles * 2);
+		code.add(word[rbp + getOffset(core, &core.pc)], (uint16_t)(dynarecPC - core.pc));
 		code.setSize(returnPointer);
 
-		code.add(rsp, 40); // restore stack to original position
+		code.add(rsp, 32); // restore stack to original position
 		code.pop(rbp);
 		code.mov(eax, cycles); // set return value as cycles taken in block
 		code.ret();
 
+		info.end(code);
+		ctx.blockInfo.push_back(std::move(info));
+
+		JitStats::bump(core.stats.blocksCompiled);
+		JitStats::set(core.stats.codeBytesUsed, code.getSize());
+
+		PerfMap::registerBlock((const void*)emittedCode, code.rx(code.getCurr()) - (const uint8_t*)emittedCode, core.pc, "cachedinterpreter");
 		return emittedCode;
 	}
 
 	// Check if code cache is close to being exhausted
-	static void checkCodeCache() {
-		if (code.getSize() + cacheLeeway > cacheSize) { //We've nearly exhausted code cache, so throw it out
-			code.reset();
-			memset(blockPageTable, 0, sizeof(blockPageTable));
+	static void checkCodeCache(CachedInterpreterContext& ctx, Chip8& core) {
+		if (!ctx.code.makeRoom(maxBlockBytes)) { //We've exhausted code cache and can't grow it, so throw it out
+			JitStats::bump(core.stats.codeBytesFlushed, ctx.code.getSize());
+			ctx.code.reset();
+			for (auto page = 0; page < (int)ctx.blockPageTable.size(); page++) {
+				clearPage(ctx, page);
+			}
+			ctx.blockInfo.clear();
 			printf("Code Cache Exhausted!!\n");
 		}
 	}
 
-	static void emitFallback(interpreterfp fallback, Chip8& core, uint16_t instr) {
+	static void emitFallback(x64Emitter& code, interpreterfp fallback, Chip8& core, uint16_t instr) {
 		//code.add(dword[rbp + getOffset(core, &core.pc)], 2);
 		code.mov(rax, (uintptr_t)fallback);
-		code.mov(rcx, (uintptr_t)&core);
-		code.mov(edx, instr);
+		code.mov(abiParam1, (uintptr_t)&core);
+		code.mov(abiParam2.cvt32(), instr);
 		code.call(rax);
 	}
 
-	//TODO: handle wrapping
-	// Invalidates all blocks from an inclusive startAddress and endAddress
-	static void invalidateRange(uint16_t startAddress, uint16_t endAddress) {
-		const auto startPage = startAddress >> pageShift;
-		const auto endPage = endAddress >> pageShift;
-		memset(&blockPageTable[startPage], 0, (endPage - startPage + 1) * sizeof(fp));
+	// Invalidate the blocks from I to I + length after a store
+	static void emitInvalidate(CachedInterpreterContext& ctx, Chip8& core, int length) {
+		auto& code = ctx.code;
+		code.inc(qword[rbp + getOffset(core, &core.stats.invalidations)]);
+		code.mov(rax, (uintptr_t)Chip8CachedInterpreter::invalidateRange);
+		code.mov(abiParam1, (uintptr_t)&ctx);
+		code.movzx(abiParam2.cvt32(), word[rbp + getOffset(core, &core.index)]);
+		code.lea(abiParam3.cvt32(), ptr[abiParam2 + length]);
+		code.call(rax);
+	}
+
+	// Invalidates all blocks from an inclusive startAddress and endAddress, stores past the top of ram wrap to 0.
+	// A block can end in an F000 nnnn hanging 2 bytes into the next page, so that page's first bytes count for the one before
+	static void invalidateRange(CachedInterpreterContext* ctx, uint16_t startAddress, uint32_t endAddress) {
+		for (auto page = (startAddress - 2) >> pageShift; page <= (int)(endAddress >> pageShift); page++) {
+			clearPage(*ctx, page & (ctx->blockPageTable.size() - 1));
+		}
+	}
+
+	// Forget a page's blocks. The page itself stays allocated for when they're recompiled, savestate loads
+	// invalidate pages every frame with run-ahead
+	static void clearPage(CachedInterpreterContext& ctx, int page) {
+		if (const auto& blocks = ctx.blockPageTable[page]) {
+			std::fill(blocks.get(), blocks.get() + pageSize, nullptr);
+		}
 	}
 };
\ No newline at end of file
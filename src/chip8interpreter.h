@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <stdio.h>
 #include <chip8.h>
@@ -16,7 +18,7 @@ class Chip8Interpreter {
 public:
 	//Returns amount of cycles it took to execute
 	//On an interpreter, this is always 1
-	static int executeFunc(Chip8& core) {
+	static int executeFunc(Chip8& core, int cycleBudget) { // always runs a single instruction
 		//printf("%04X\n", core.pc);
 		auto instr = core.read<uint16_t>(core.pc);
 		core.pc += 2;
@@ -24,9 +26,17 @@ public:
 		switch (getidentifier(instr)) {
 		case 0x0:
 			switch (getaddr(instr)) {
-			case 0x0E0: Chip8Interpreter::CLS(core, instr); break;
-			case 0x0EE: Chip8Interpreter::RET(core, instr); break;
+			case 0x0E0: Chip8Interpreter::CLS(core, instr);  break;
+			case 0x0EE: Chip8Interpreter::RET(core, instr);  break;
+			case 0x0FB: Chip8Interpreter::SCR(core, instr);  break;
+			case 0x0FC: Chip8Interpreter::SCL(core, instr);  break;
+			case 0x0FE: Chip8Interpreter::LOW(core, instr);  break;
+			case 0x0FF: Chip8Interpreter::HIGH(core, instr); break;
 			default:
+				if ((getaddr(instr) & 0xff0) == 0x0C0) {
+					Chip8Interpreter::SCD(core, instr);
+					break;
+				}
 				printf("Unimplemented Instruction - %04X\n", instr);
 				exit(1);
 			}
@@ -36,7 +46,17 @@ public:
 		case 0x2: Chip8Interpreter::CALL(core, instr);      break;
 		case 0x3: Chip8Interpreter::SEVxByte(core, instr);  break;
 		case 0x4: Chip8Interpreter::SNEVxByte(core, instr); break;
-		case 0x5: Chip8Interpreter::SEVxVy(core, instr);    break;
+		case 0x5:
+			switch (getn(instr)) {
+			case 0x0: Chip8Interpreter::SEVxVy(core, instr);   break;
+			case 0x2: Chip8Interpreter::SAVEVxVy(core, instr); break;
+			case 0x3: Chip8Interpreter::LOADVxVy(core, instr); break;
+			default:
+				printf("Unimplemented Instruction - %04X\n", instr);
+				//exit(1);
+			}
+
+			break;
 		case 0x6: Chip8Interpreter::LDVxByte(core, instr);  break;
 		case 0x7: Chip8Interpreter::ADDVxByte(core, instr); break;
 		case 0x8:
@@ -73,6 +93,14 @@ public:
 			break;
 		case 0xF:
 			switch (getkk(instr)) {
+			case 0x00:
+				if (instr == 0xF000) {
+					Chip8Interpreter::LDILong(core, instr);
+					break;
+				}
+				printf("Unimplemented Instruction - %04X\n", instr);
+				break;
+			case 0x01: Chip8Interpreter::PLANE(core, instr);  break;
 			case 0x07: Chip8Interpreter::LDVxDT(core, instr); break;
 			case 0x0A: Chip8Interpreter::LDVxK(core, instr);  break;
 			case 0x15: Chip8Interpreter::LDDTVx(core, instr); break;
@@ -95,12 +123,76 @@ public:
 		return 1;
 	};
 
+	// Call f with the first word of every XO-CHIP plane selected for drawing
+	template <typename F>
+	static void forEachPlane(Chip8& core, F&& f) {
+		for (auto plane = 0; plane < DISPLAY_PLANES; plane++) {
+			if (core.planes & (1 << plane)) {
+				f(core.display.data() + plane * PLANE_WORDS);
+			}
+		}
+	}
+
+	// Skips hop over all 4 bytes of F000 nnnn
+	static void skipNext(Chip8& core) {
+		core.pc += core.read<uint16_t>(core.pc) == 0xF000 ? 4 : 2;
+	}
+
 	static void CLS(Chip8& core, uint16_t instr) { //0x00E0
-		core.display.fill(0);
+		forEachPlane(core, [](uint64_t* plane) {
+			std::fill(plane, plane + PLANE_WORDS, 0);
+		});
 	}
 
+	// The stack wraps at 16 entries, so unbalanced calls and returns can't write past it
+
 	static void RET(Chip8& core, uint16_t instr) { //0x00EE (post-increment)
-		core.pc = core.stack[--core.sp];
+		core.pc = core.stack[--core.sp & 15];
+	}
+
+	// SCHIP scrolls count pixels of the current mode. Lores rows past the screen stay clear,
+	// as only the visible rows are moved and nothing is shifted into the right words
+
+	static void SCD(Chip8& core, uint16_t instr) { //0x00Cn
+		const auto rows = core.hires ? HIRES_HEIGHT : HEIGHT;
+		const auto n = std::min((int)getn(instr), rows);
+		forEachPlane(core, [&](uint64_t* plane) {
+			memmove(plane + n * 2, plane, (rows - n) * 2 * sizeof(uint64_t));
+			memset(plane, 0, n * 2 * sizeof(uint64_t));
+		});
+	}
+
+	static void SCR(Chip8& core, uint16_t instr) { //0x00FB
+		forEachPlane(core, [&](uint64_t* plane) {
+			for (auto row = 0; row < HIRES_HEIGHT; row++) {
+				auto& left = plane[row * 2];
+				auto& right = plane[row * 2 + 1];
+				right = core.hires ? (right >> 4) | (left << 60) : 0;
+				left >>= 4;
+			}
+		});
+	}
+
+	static void SCL(Chip8& core, uint16_t instr) { //0x00FC
+		forEachPlane(core, [](uint64_t* plane) {
+			for (auto row = 0; row < HIRES_HEIGHT; row++) {
+				auto& left = plane[row * 2];
+				auto& right = plane[row * 2 + 1];
+				left = (left << 4) | (right >> 60);
+				right <<= 4;
+			}
+		});
+	}
+
+	// Switching modes clears every plane, so neither mode sees the other's layout
+	static void LOW(Chip8& core, uint16_t instr) { //0x00FE
+		core.hires = 0;
+		core.display.fill(0);
+	}
+
+	static void HIGH(Chip8& core, uint16_t instr) { //0x00FF
+		core.hires = 1;
+		core.display.fill(0);
 	}
 
 	static void JP(Chip8& core, uint16_t instr) { //0x1nnn
@@ -108,25 +200,44 @@ public:
 	}
 
 	static void CALL(Chip8& core, uint16_t instr) { //0x2nnn (post-increment)
-		core.stack[core.sp++] = core.pc;
+		core.stack[core.sp++ & 15] = core.pc;
 		core.pc = getaddr(instr);
 	}
 
 	static void SEVxByte(Chip8& core, uint16_t instr) { //0x3xkk
 		if (core.gpr[getx(instr)] == getkk(instr)) {
-			core.pc += 2;
+			skipNext(core);
 		}
 	}
 
 	static void SNEVxByte(Chip8& core, uint16_t instr) { //0x4xkk
 		if (core.gpr[getx(instr)] != getkk(instr)) {
-			core.pc += 2;
+			skipNext(core);
 		}
 	}
 
 	static void SEVxVy(Chip8& core, uint16_t instr) { //0x5xy0
 		if (core.gpr[getx(instr)] == core.gpr[gety(instr)]) {
-			core.pc += 2;
+			skipNext(core);
+		}
+	}
+
+	// XO-CHIP register ranges go from Vx to Vy, backwards if x > y. I is left alone, and like Fx55/Fx65 they run on
+	// into RAM_GUARD at the top of ram rather than wrapping
+
+	static void SAVEVxVy(Chip8& core, uint16_t instr) { //0x5xy2
+		const auto step = getx(instr) <= gety(instr) ? 1 : -1;
+		for (auto i = 0, reg = (int)getx(instr); ; i++, reg += step) {
+			core.ram[core.index + i] = core.gpr[reg];
+			if (reg == gety(instr)) break;
+		}
+	}
+
+	static void LOADVxVy(Chip8& core, uint16_t instr) { //0x5xy3
+		const auto step = getx(instr) <= gety(instr) ? 1 : -1;
+		for (auto i = 0, reg = (int)getx(instr); ; i++, reg += step) {
+			core.gpr[reg] = core.ram[core.index + i];
+			if (reg == gety(instr)) break;
 		}
 	}
 
@@ -154,34 +265,41 @@ public:
 		core.gpr[getx(instr)] ^= core.gpr[gety(instr)];
 	}
 
+	// The flag is written after the result, so with x = F the flag is what's left in VF. Same as the recompilers
+
 	static void ADDVxVy(Chip8& core, uint16_t instr) { //0x8xy4
-		core.gpr[0xf] = ((uint16_t)core.gpr[getx(instr)] + (uint16_t)core.gpr[gety(instr)]) > 0xff;
+		const uint8_t flag = ((uint16_t)core.gpr[getx(instr)] + (uint16_t)core.gpr[gety(instr)]) > 0xff;
 		core.gpr[getx(instr)] += core.gpr[gety(instr)];
+		core.gpr[0xf] = flag;
 	}
 
 	static void SUBVxVy(Chip8& core, uint16_t instr) { //0x8xy5
-		core.gpr[0xf] = core.gpr[getx(instr)] > core.gpr[gety(instr)];
+		const uint8_t flag = core.gpr[getx(instr)] > core.gpr[gety(instr)];
 		core.gpr[getx(instr)] -= core.gpr[gety(instr)];
+		core.gpr[0xf] = flag;
 	}
 
 	static void SHRVxVy(Chip8& core, uint16_t instr) { //0x8xy6
-		core.gpr[0xf] = core.gpr[getx(instr)] & 1;
+		const uint8_t flag = core.gpr[getx(instr)] & 1;
 		core.gpr[getx(instr)] >>= 1;
+		core.gpr[0xf] = flag;
 	}
 
 	static void SUBNVxVy(Chip8& core, uint16_t instr) { //0x8xy7
-		core.gpr[0xf] = core.gpr[gety(instr)] > core.gpr[getx(instr)];
+		const uint8_t flag = core.gpr[gety(instr)] > core.gpr[getx(instr)];
 		core.gpr[getx(instr)] = core.gpr[gety(instr)] - core.gpr[getx(instr)];
+		core.gpr[0xf] = flag;
 	}
 
 	static void SHLVxVy(Chip8& core, uint16_t instr) { //0x8xyE
-		core.gpr[0xf] = (core.gpr[getx(instr)] & 0x80) >> 7;
+		const uint8_t flag = (core.gpr[getx(instr)] & 0x80) >> 7;
 		core.gpr[getx(instr)] <<= 1;
+		core.gpr[0xf] = flag;
 	}
 
 	static void SNEVxVy(Chip8& core, uint16_t instr) { //0x9xy0
 		if (core.gpr[getx(instr)] != core.gpr[gety(instr)]) {
-			core.pc += 2;
+			skipNext(core);
 		}
 	}
 
@@ -194,47 +312,69 @@ public:
 	}
 
 	static void RNDVxByte(Chip8& core, uint16_t instr) { //0xCxkk
-		core.gpr[getx(instr)] = (rand() % 256) & getkk(instr);
+		core.gpr[getx(instr)] = core.randomByte() & getkk(instr);
 	}
 
+	// Dxy0 draws a 16x16 sprite in either mode. With more than one plane selected, each plane's sprite follows the
+	// previous one's in ram
 	static void DXYN(Chip8& core, uint16_t instr) { //0xDxyn
-		const auto startX = core.gpr[getx(instr)] & 63;
-		const auto startY = core.gpr[gety(instr)] & 31;
+		const auto width = core.hires ? HIRES_WIDTH : WIDTH;
+		const auto height = core.hires ? HIRES_HEIGHT : HEIGHT;
+		const auto startX = core.gpr[getx(instr)] & (width - 1);
+		const auto startY = core.gpr[gety(instr)] & (height - 1);
+		const auto wide = getn(instr) == 0;
+		const auto lines = wide ? 16 : getn(instr);
+		int sprite = core.index; // later planes' sprites run on into RAM_GUARD too, like the recompilers'
 		core.gpr[0xf] = 0;
 
-		for (auto y = 0; y < getn(instr); y++) {
-			if (startY + y == HEIGHT) return;
+		forEachPlane(core, [&](uint64_t* plane) {
+			for (auto y = 0; y < lines && startY + y < height; y++) {
+				uint64_t spriteLine = wide ? ((uint64_t)core.ram[sprite + y * 2] << 56) | ((uint64_t)core.ram[sprite + y * 2 + 1] << 48)
+					: (uint64_t)core.ram[sprite + y] << 56;
 
-			uint64_t spriteLine = (uint64_t)core.ram[core.index + y];
-			spriteLine = (spriteLine << 56) >> startX;
-			uint64_t& displayLine = core.display[startY + y];
-			core.gpr[0xf] |= (displayLine & spriteLine) != 0;
-			displayLine ^= spriteLine;
-		}
+				// Split the sprite across the row's words, lores rows clip at the left word
+				const uint64_t left = startX < 64 ? spriteLine >> startX : 0;
+				const uint64_t right = !core.hires || startX == 0 ? 0 : startX < 64 ? spriteLine << (64 - startX) : spriteLine >> (startX - 64);
+
+				uint64_t* displayLine = &plane[(startY + y) * 2];
+				core.gpr[0xf] |= ((displayLine[0] & left) | (displayLine[1] & right)) != 0;
+				displayLine[0] ^= left;
+				displayLine[1] ^= right;
+			}
+			sprite += lines * (wide ? 2 : 1);
+		});
 	}
 
 	static void SKPVx(Chip8& core, uint16_t instr) { //Ex9E
-		if (core.keyState[core.gpr[getx(instr)]]) {
-			core.pc += 2;
+		if ((core.keyState.load(std::memory_order_relaxed) >> (core.gpr[getx(instr)] & 0xf)) & 1) {
+			skipNext(core);
 		}
 	}
 
 	static void SKNPVx(Chip8& core, uint16_t instr) { //ExA1
-		if (!core.keyState[core.gpr[getx(instr)]]) {
-			core.pc += 2;
+		if (!((core.keyState.load(std::memory_order_relaxed) >> (core.gpr[getx(instr)] & 0xf)) & 1)) {
+			skipNext(core);
 		}
 	}
 
+	static void LDILong(Chip8& core, uint16_t instr) { //0xF000 nnnn
+		core.index = core.read<uint16_t>(core.pc);
+		core.pc += 2;
+	}
+
+	static void PLANE(Chip8& core, uint16_t instr) { //0xFn01
+		core.planes = getx(instr) & 3;
+	}
+
 	static void LDVxDT(Chip8& core, uint16_t instr) { //0xFx07
 		core.gpr[getx(instr)] = core.delay;
 	}
 
 	static void LDVxK(Chip8& core, uint16_t instr) { //0xFx0A
-		for (auto i = 0; i < core.keyState.size(); i++) {
-			if (core.keyState[i]) {
-				core.gpr[getx(instr)] = i;
-				return;
-			}
+		const auto keys = core.keyState.load(std::memory_order_relaxed);
+		if (keys) {
+			core.gpr[getx(instr)] = std::countr_zero(keys); // lowest held key
+			return;
 		}
 		core.pc -= 2;
 	}
@@ -0,0 +1,154 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <jitcommon.h>
+#include <disassembler.h>
+
+#ifdef JIT8_HAS_CAPSTONE
+#include <capstone/capstone.h>
+#endif
+
+// Writes a backend's code cache to emittedcode_<backend>.bin, plus an annotated emittedcode_<backend>.txt
+// mapping every block's guest instructions to the host code they were compiled to, and how many bytes each
+// kind of guest instruction costs. Host code is disassembled if built with capstone, otherwise it's hex
+class CodeCacheDump {
+public:
+	static void dump(const char* backend, const x64Emitter& code, const std::vector<BlockInfo>& blocks) {
+		if (blocks.empty()) { // nothing was recompiled with this backend
+			return;
+		}
+
+		const auto base = std::string("emittedcode_") + backend;
+		if (FILE* bin = fopen((base + ".bin").c_str(), "wb")) {
+			fwrite(code.getCode(), 1, code.getSize(), bin);
+			fclose(bin);
+		}
+
+		FILE* file = fopen((base + ".txt").c_str(), "w");
+		if (!file) {
+			printf("Couldn't open %s.txt\n", base.c_str());
+			return;
+		}
+
+		fprintf(file, "%s code cache: %zu bytes, %zu blocks, based at %p%s\n", backend, code.getSize(), blocks.size(),
+			(const void*)code.rx(code.getCode()), code.isDualMapped() ? " (written through a separate RW view)" : "");
+#ifndef JIT8_HAS_CAPSTONE
+		fprintf(file, "Built without capstone, disassemble the .bin with\n");
+		fprintf(file, "  objdump -D -b binary -mi386:x86-64 --start-address=<host offset> %s.bin\n", base.c_str());
+#endif
+
+		dumpStats(file, blocks);
+
+		for (const auto& block : blocks) {
+			fprintf(file, "\nblock 0x%03X-0x%03X  host +0x%08zX, %zu bytes, %zu instrs, %.1f bytes/instr\n",
+				block.startPC, block.endPC - 2, block.hostOffset, block.hostSize, block.instrs.size(),
+				(double)block.hostSize / block.instrs.size());
+
+			const auto blockCode = code.getCode() + block.hostOffset;
+			fprintf(file, "  prologue\n");
+			dumpHostCode(file, blockCode, block.hostOffset, 0, block.guestOffsets[0]);
+
+			auto pc = block.startPC;
+			auto operand = block.longOperands.begin();
+			for (auto i = 0; i < block.instrs.size(); i++) {
+				const auto start = block.guestOffsets[i];
+				const auto end = i + 1 < block.instrs.size() ? block.guestOffsets[i + 1] : block.epilogueOffset;
+				if (block.instrs[i] == 0xF000) {
+					char text[32];
+					snprintf(text, sizeof(text), "LD I, long 0x%04X", *operand);
+					fprintf(file, "  0x%03X: F000 %04X  %-18s (%zu bytes)\n", pc, *operand, text, end - start);
+					++operand;
+					pc += 4;
+				} else {
+					fprintf(file, "  0x%03X: %04X       %-18s (%zu bytes)\n", pc, block.instrs[i],
+						Chip8Disassembler::disassemble(block.instrs[i]).c_str(), end - start);
+					pc += 2;
+				}
+				dumpHostCode(file, blockCode, block.hostOffset, start, end);
+			}
+
+			fprintf(file, "  epilogue\n");
+			dumpHostCode(file, blockCode, block.hostOffset, block.epilogueOffset, block.hostSize);
+		}
+
+		fclose(file);
+	}
+
+private:
+	// Host bytes per guest instruction, per kind of instruction, biggest total first
+	static void dumpStats(FILE* file, const std::vector<BlockInfo>& blocks) {
+		struct Stat {
+			size_t count = 0;
+			size_t bytes = 0;
+			size_t max = 0;
+		};
+
+		std::map<std::string, Stat> stats;
+		size_t guestInstrs = 0;
+		size_t bodyBytes = 0;
+		size_t overheadBytes = 0; // prologues and epilogues
+
+		for (const auto& block : blocks) {
+			overheadBytes += block.guestOffsets[0] + (block.hostSize - block.epilogueOffset);
+
+			for (auto i = 0; i < block.instrs.size(); i++) {
+				const auto end = i + 1 < block.instrs.size() ? block.guestOffsets[i + 1] : block.epilogueOffset;
+				const auto size = end - block.guestOffsets[i];
+
+				auto& stat = stats[Chip8Disassembler::opcodeClass(block.instrs[i])];
+				++stat.count;
+				stat.bytes += size;
+				stat.max = std::max(stat.max, size);
+
+				++guestInstrs;
+				bodyBytes += size;
+			}
+		}
+
+		std::vector<std::pair<std::string, Stat>> sorted(stats.begin(), stats.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+			return a.second.bytes > b.second.bytes;
+		});
+
+		fprintf(file, "\n%zu guest instructions, %.1f host bytes per guest instruction (%.1f including prologue/epilogue)\n",
+			guestInstrs, (double)bodyBytes / guestInstrs, (double)(bodyBytes + overheadBytes) / guestInstrs);
+		fprintf(file, "prologue + epilogue: %.1f bytes per block\n\n", (double)overheadBytes / blocks.size());
+
+		fprintf(file, "opcode          count   total bytes   bytes/instr   max\n");
+		for (const auto& [opcode, stat] : sorted) {
+			fprintf(file, "%-14s %6zu  %12zu  %12.1f  %4zu\n", opcode.c_str(), stat.count, stat.bytes,
+				(double)stat.bytes / stat.count, stat.max);
+		}
+	}
+
+	static void dumpHostCode(FILE* file, const uint8_t* blockCode, size_t blockOffset, size_t start, size_t end) {
+		if (start >= end) {
+			return;
+		}
+
+#ifdef JIT8_HAS_CAPSTONE
+		csh handle;
+		if (cs_open(CS_ARCH_X86, CS_MODE_64, &handle) == CS_ERR_OK) {
+			cs_insn* insns;
+			const auto count = cs_disasm(handle, blockCode + start, end - start, blockOffset + start, 0, &insns);
+			for (size_t i = 0; i < count; i++) {
+				fprintf(file, "      +0x%08llX  %-8s %s\n", (unsigned long long)insns[i].address, insns[i].mnemonic, insns[i].op_str);
+			}
+			cs_free(insns, count);
+			cs_close(&handle);
+			return;
+		}
+#endif
+
+		for (auto row = start; row < end; row += 16) {
+			fprintf(file, "      +0x%08zX ", blockOffset + row);
+			for (auto i = row; i < std::min(row + 16, end); i++) {
+				fprintf(file, " %02X", blockCode[i]);
+			}
+			fprintf(file, "\n");
+		}
+	}
+};
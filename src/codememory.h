@@ -0,0 +1,196 @@
+#pragma once
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <xbyak/xbyak.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Backing memory for a code cache, handed to xbyak as its allocator.
+// On linux it's a memfd mapped twice: code is written through a RW view and run through a RX view, so no page is ever
+// writable and executable at once and hardened kernels that refuse RWE mappings are fine with it. Pages are only
+// committed once code gets written to them. Big caches come from the hugetlb pool if the system has one set aside,
+// otherwise we ask for transparent huge pages, either way to go easier on the iTLB.
+// Anywhere else (or if memfds aren't available) it's a single RWE mapping, and both views are the same.
+//
+// Address space for the largest the cache may get is reserved up front, and the usable part grows in place,
+// so nothing emitted ever moves
+class CodeMemory : public Xbyak::Allocator {
+public:
+	explicit CodeMemory(size_t reserveSize) : reserveSize(reserveSize) {}
+
+	~CodeMemory() override {
+		release();
+	}
+
+	uint8_t* alloc(size_t size) override {
+#ifdef __linux__
+		if ((size >= hugePageSize && mapDual(size, true)) || mapDual(size, false)) {
+			return rwBase;
+		}
+#endif
+		return mapRWE(size);
+	}
+
+	void free(uint8_t* p) override {
+		release();
+	}
+
+	bool useProtect() const override { // the views already have the protection they need
+		return false;
+	}
+
+	// Make the first size bytes usable, false if that's past the reservation
+	bool commit(size_t size) {
+		const auto length = roundUp(size, granule);
+		if (length <= committed) {
+			return true;
+		}
+		if (length > reserved) {
+			return false;
+		}
+
+#ifdef _WIN32
+		if (!VirtualAlloc(rwBase + committed, length - committed, MEM_COMMIT, PAGE_EXECUTE_READWRITE)) {
+			return false;
+		}
+#else
+		if (fd >= 0) {
+			if (ftruncate(fd, length) != 0 ||
+				mmap(rwBase + committed, length - committed, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, committed) == MAP_FAILED ||
+				mmap(rxBase + committed, length - committed, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, committed) == MAP_FAILED) {
+				return false;
+			}
+		}
+		else if (mprotect(rwBase + committed, length - committed, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+			return false;
+		}
+#endif
+		committed = length;
+		return true;
+	}
+
+	size_t committedSize() const {
+		return committed;
+	}
+
+	// Where code written at p runs
+	const uint8_t* rx(const void* p) const {
+		return (const uint8_t*)p + delta;
+	}
+
+	// Where code running at p is written
+	uint8_t* rw(const void* p) const {
+		return (uint8_t*)p - delta;
+	}
+
+	bool isDualMapped() const {
+		return delta != 0;
+	}
+
+private:
+	static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+	static constexpr size_t pageSize = 4096;
+
+	const size_t reserveSize;
+	uint8_t* rwBase = nullptr;
+	uint8_t* rxBase = nullptr;
+	size_t granule = pageSize; // commits are rounded up to this
+	size_t reserved = 0;
+	size_t committed = 0;
+	ptrdiff_t delta = 0; // rxBase - rwBase
+	int fd = -1;         // memfd backing both views
+
+	// Reservations of each view, which can start below the view to align it
+	uint8_t* rwReservation = nullptr;
+	uint8_t* rxReservation = nullptr;
+	size_t reservationSize = 0;
+
+	static size_t roundUp(size_t size, size_t alignment) {
+		return (size + alignment - 1) & ~(alignment - 1);
+	}
+
+#ifndef _WIN32
+	// Inaccessible address space to map views into, aligned to the granule
+	uint8_t* reserveAligned(size_t size, uint8_t*& reservation) {
+		const auto p = mmap(nullptr, size + granule, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED) {
+			return nullptr;
+		}
+		reservation = (uint8_t*)p;
+		return (uint8_t*)roundUp((uintptr_t)p, granule);
+	}
+#endif
+
+#ifdef __linux__
+	bool mapDual(size_t size, bool huge) {
+		granule = huge ? hugePageSize : pageSize;
+		reserved = roundUp(std::max(size, reserveSize), granule);
+		reservationSize = reserved + granule;
+
+		fd = memfd_create("jit8-code-cache", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+		if (fd >= 0) {
+			rwBase = reserveAligned(reserved, rwReservation);
+			rxBase = reserveAligned(reserved, rxReservation);
+
+			// No hugetlb pool, or exec mappings of memfds are denied
+			if (rwBase && rxBase && commit(size)) {
+				if (!huge) { // only a hint, shmem THP might be disabled
+					madvise(rwBase, reserved, MADV_HUGEPAGE);
+					madvise(rxBase, reserved, MADV_HUGEPAGE);
+				}
+
+				delta = rxBase - rwBase;
+				return true;
+			}
+		}
+
+		release();
+		return false;
+	}
+#endif
+
+	uint8_t* mapRWE(size_t size) {
+		granule = pageSize;
+		reserved = roundUp(std::max(size, reserveSize), granule);
+
+#ifdef _WIN32
+		rwBase = (uint8_t*)VirtualAlloc(nullptr, reserved, MEM_RESERVE, PAGE_NOACCESS);
+		rwReservation = rwBase;
+#else
+		reservationSize = reserved + granule;
+		rwBase = reserveAligned(reserved, rwReservation);
+#endif
+		rxBase = rwBase;
+		if (!rwBase || !commit(size)) {
+			release();
+			return nullptr;
+		}
+		return rwBase;
+	}
+
+	void release() {
+#ifdef _WIN32
+		if (rwReservation) {
+			VirtualFree(rwReservation, 0, MEM_RELEASE);
+		}
+#else
+		if (rwReservation) {
+			munmap(rwReservation, reservationSize);
+		}
+		if (rxReservation) {
+			munmap(rxReservation, reservationSize);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+		rwBase = rxBase = rwReservation = rxReservation = nullptr;
+		reserved = committed = reservationSize = 0;
+		delta = 0;
+		fd = -1;
+	}
+};
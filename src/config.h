@@ -0,0 +1,223 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+enum class Backend {
+	Interpreter,
+	CachedInterpreter,
+	Dynarec,
+	AOT,
+};
+
+inline const char* backendName(Backend backend) {
+	switch (backend) {
+	case Backend::Interpreter:       return "interpreter";
+	case Backend::CachedInterpreter: return "cachedinterpreter";
+	case Backend::Dynarec:           return "dynarec";
+	case Backend::AOT:               return "aot";
+	}
+	return "???";
+}
+
+// Widest vectors the recompilers' SIMD emitters use (see HostCpu in jitcommon.h)
+enum class SimdLevel {
+	SSE2,
+	AVX2,
+	AVX512,
+};
+
+inline const char* simdName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::SSE2:   return "sse2";
+	case SimdLevel::AVX2:   return "avx2";
+	case SimdLevel::AVX512: return "avx512";
+	}
+	return "???";
+}
+
+// Runtime configuration, filled in from the command line
+struct Config {
+	const char* romPath = "../../roms/invaders";
+	Backend backend = Backend::Dynarec;
+	int speed = 600; //how many cycles executed in a second
+	uint32_t seed = 0; //Cxkk's rng seed, 0 picks one
+	SimdLevel maxSimd = SimdLevel::AVX512; //the recompilers use the best the host has, up to this
+
+	//Frame pacing
+	double targetRate = 60.0; //frames per second the emu thread is paced to
+	int emuThreadCpu = -1;    //cpu the emu thread is pinned to, -1 lets the os decide
+	bool reportJitter = false; //print frame time percentiles once a second
+
+	//Audio
+	bool muteFastForward = true; //mute while the frame limiter is off, otherwise keep following the sound timer
+
+	//Save states
+	double rewindSeconds = 0; //seconds of rewind history kept (hold backspace), 0 disables it
+	int runAhead = 0;         //frames emulated ahead of the one shown, then rolled back, to hide input latency
+
+	//Input logs (see replay.h)
+	const char* recordPath = nullptr; //log the seed and every frame's keypad state here
+	const char* replayPath = nullptr; //replay a log headless on every backend against the interpreter, no window
+	const char* hashesPath = nullptr; //with --replay, write the interpreter's per frame display hashes here
+
+	//Test roms (see conformance.h)
+	const char* conformancePath = nullptr; //run every rom in here headless on every backend against its golden image
+	bool bless = false; //with --conformance, write the golden images from the interpreter instead
+	bool checkDisassembler = false; //check the disassembler against known encodings and exit
+
+	//Differential fuzzing (see fuzzer.h)
+	int fuzzPrograms = 0; //random programs to run on --backend and the interpreter in lockstep, 0 disables it
+
+	//Opcode micro-benchmarks (see benchmark.h)
+	const char* benchFilter = nullptr; //run the benchmarks with this in their name, "all" for every one
+	bool eliminateDeadWrites = true;   //off for the benchmarks, or only the last of the repeated copies gets compiled
+
+	//Instrumentation
+	bool profileBlocks = false; //count block executions and write a hotspot report on exit
+	bool profileCycles = false; //also count retired cycles per block
+	bool perfMap = false;       //name recompiled blocks in /tmp/perf-<pid>.map
+	bool jitdump = false;       //write recompiled blocks and their code to jit-<pid>.dump for perf inject
+	double statsInterval = 0;   //seconds between runtime stats lines, 0 disables them
+	const char* statsPath = nullptr; //file to write stats to, stdout if null
+	bool dumpCode = true;       //write the code caches to emittedcode_<backend>.bin/txt on exit
+
+	static void printUsage(const char* name) {
+		printf("Usage: %s [options]\n", name);
+		printf("  --rom <path>      rom to run (default ../../roms/invaders)\n");
+		printf("  --backend <name>  interpreter, cachedinterpreter, dynarec (default) or aot\n");
+		printf("  --speed <cycles>  instructions executed per second (default 600)\n");
+		printf("  --seed <n>        seed for Cxkk's random numbers (default picks one)\n");
+		printf("  --simd <level>    recompile with at most sse2, avx2 or avx512 (default the best the cpu has)\n");
+		printf("  --rate <hz>       target frame rate of the frame limiter (default 60)\n");
+		printf("  --cpu <n>         pin the emulation thread to cpu n\n");
+		printf("  --jitter          print frame time percentiles every second\n");
+		printf("  --ff-audio        keep sound on while fast forwarding instead of muting it\n");
+		printf("  --rewind <secs>   keep <secs> seconds of rewind history, hold backspace to rewind\n");
+		printf("  --run-ahead <n>   show the frame n frames ahead of the emulated one, to hide input lag\n");
+		printf("  --record <file>   log the rng seed and keypad state of every frame to <file>\n");
+		printf("  --replay <file>   replay a log headless on every backend, report where they stop matching the interpreter\n");
+		printf("  --hashes <file>   with --replay, write the interpreter's display hash for every frame to <file>\n");
+		printf("  --conformance <dir> run the roms in <dir> on every backend, check their screens against <dir>/golden\n");
+		printf("  --bless           with --conformance, (re)write the golden images from the interpreter\n");
+		printf("  --check-disassembler check the disassembler against known encodings\n");
+		printf("  --fuzz <n>        run n random programs on --backend and the interpreter in lockstep, --seed picks them\n");
+		printf("  --bench <filter>  time single opcodes on every backend, those with <filter> in their name or all\n");
+		printf("  --profile         count recompiled block executions, report hotspots to hotspots.txt on exit\n");
+		printf("  --profile-cycles  like --profile, also counting retired cycles per block\n");
+		printf("  --perf-map        name recompiled blocks for linux perf in /tmp/perf-<pid>.map\n");
+		printf("  --jitdump         write recompiled code to jit-<pid>.dump for perf inject --jit\n");
+		printf("  --stats <secs>    print runtime stats every <secs> seconds\n");
+		printf("  --stats-file <f>  write runtime stats to <f> instead of stdout (implies --stats 1)\n");
+		printf("  --no-dump         don't write the code caches out on exit\n");
+	}
+
+	static Config fromArgs(int argc, char** argv) {
+		Config config;
+
+		for (auto i = 1; i < argc; i++) {
+			const auto arg = argv[i];
+			const auto hasValue = i + 1 < argc;
+
+			if (!strcmp(arg, "--rom") && hasValue) {
+				config.romPath = argv[++i];
+			} else if (!strcmp(arg, "--backend") && hasValue) {
+				const auto name = argv[++i];
+				if (!parseBackend(name, config.backend)) {
+					printf("Unknown backend - %s\n", name);
+					printUsage(argv[0]);
+					exit(1);
+				}
+			} else if (!strcmp(arg, "--speed") && hasValue) {
+				config.speed = atoi(argv[++i]);
+			} else if (!strcmp(arg, "--seed") && hasValue) {
+				config.seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+			} else if (!strcmp(arg, "--simd") && hasValue) {
+				const auto name = argv[++i];
+				if (!parseSimd(name, config.maxSimd)) {
+					printf("Unknown SIMD level - %s\n", name);
+					printUsage(argv[0]);
+					exit(1);
+				}
+			} else if (!strcmp(arg, "--rate") && hasValue) {
+				config.targetRate = atof(argv[++i]);
+			} else if (!strcmp(arg, "--cpu") && hasValue) {
+				config.emuThreadCpu = atoi(argv[++i]);
+			} else if (!strcmp(arg, "--jitter")) {
+				config.reportJitter = true;
+			} else if (!strcmp(arg, "--ff-audio")) {
+				config.muteFastForward = false;
+			} else if (!strcmp(arg, "--rewind") && hasValue) {
+				config.rewindSeconds = atof(argv[++i]);
+			} else if (!strcmp(arg, "--run-ahead") && hasValue) {
+				config.runAhead = atoi(argv[++i]);
+			} else if (!strcmp(arg, "--record") && hasValue) {
+				config.recordPath = argv[++i];
+			} else if (!strcmp(arg, "--replay") && hasValue) {
+				config.replayPath = argv[++i];
+			} else if (!strcmp(arg, "--hashes") && hasValue) {
+				config.hashesPath = argv[++i];
+			} else if (!strcmp(arg, "--conformance") && hasValue) {
+				config.conformancePath = argv[++i];
+			} else if (!strcmp(arg, "--bless")) {
+				config.bless = true;
+			} else if (!strcmp(arg, "--check-disassembler")) {
+				config.checkDisassembler = true;
+			} else if (!strcmp(arg, "--fuzz") && hasValue) {
+				config.fuzzPrograms = atoi(argv[++i]);
+			} else if (!strcmp(arg, "--bench") && hasValue) {
+				config.benchFilter = argv[++i];
+			} else if (!strcmp(arg, "--profile")) {
+				config.profileBlocks = true;
+			} else if (!strcmp(arg, "--profile-cycles")) {
+				config.profileBlocks = true;
+				config.profileCycles = true;
+			} else if (!strcmp(arg, "--perf-map")) {
+				config.perfMap = true;
+			} else if (!strcmp(arg, "--jitdump")) {
+				config.jitdump = true;
+			} else if (!strcmp(arg, "--stats") && hasValue) {
+				config.statsInterval = atof(argv[++i]);
+			} else if (!strcmp(arg, "--stats-file") && hasValue) {
+				config.statsPath = argv[++i];
+				if (config.statsInterval <= 0) {
+					config.statsInterval = 1;
+				}
+			} else if (!strcmp(arg, "--no-dump")) {
+				config.dumpCode = false;
+			} else {
+				printf("Unknown option - %s\n", arg);
+				printUsage(argv[0]);
+				exit(1);
+			}
+		}
+
+		if (config.speed <= 0 || config.targetRate <= 0) {
+			printf("Speed and rate must be positive\n");
+			exit(1);
+		}
+
+		return config;
+	}
+
+	static bool parseBackend(const char* name, Backend& backend) {
+		for (auto candidate : { Backend::Interpreter, Backend::CachedInterpreter, Backend::Dynarec, Backend::AOT }) {
+			if (!strcmp(name, backendName(candidate))) {
+				backend = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static bool parseSimd(const char* name, SimdLevel& level) {
+		for (auto candidate : { SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512 }) {
+			if (!strcmp(name, simdName(candidate))) {
+				level = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+};
@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <chip8.h>
+#include <config.h>
+#include <jitcommon.h>
+
+// Runs every .ch8 in a directory headless (--conformance), on every backend, for a fixed number of cycles, and checks
+// the screen it ends on against the golden image in <dir>/golden/<rom>.txt. Test roms draw their results and then
+// spin, so the last screen is all there is to check. Each run is timed too, so one pass covers correctness and speed.
+// --bless writes the goldens from the interpreter instead. A generated program of the biggest blocks there are is
+// checked too, see checkBigBlocks
+class Conformance {
+public:
+	using clock = std::chrono::steady_clock;
+	static constexpr int cycles = 20000; // the bundled roms are done after a few thousand
+
+	// Process exit code, non zero if any run didn't match its golden image
+	static int run(const Config& config) {
+		namespace fs = std::filesystem;
+		const fs::path dir = config.conformancePath;
+
+		std::vector<fs::path> roms;
+		std::error_code error;
+		for (const auto& entry : fs::directory_iterator(dir, error)) {
+			if (entry.is_regular_file() && entry.path().extension() == ".ch8") {
+				roms.push_back(entry.path());
+			}
+		}
+		if (error || roms.empty()) {
+			printf("No .ch8 roms in %s\n", config.conformancePath);
+			return 1;
+		}
+		std::sort(roms.begin(), roms.end());
+
+		auto headless = config;
+		headless.seed = headless.seed ? headless.seed : 1; // Cxkk has to come out the same on every run
+		headless.recordPath = nullptr;
+		headless.dumpCode = false;
+
+		const auto goldenDir = dir / "golden";
+		if (config.bless) {
+			fs::create_directories(goldenDir, error);
+		}
+
+		auto failed = 0;
+		for (const auto& rom : roms) {
+			const auto romPath = rom.string();
+			const auto goldenPath = (goldenDir / rom.stem()).string() + ".txt";
+			headless.romPath = romPath.c_str();
+
+			if (config.bless) {
+				const auto image = render(*runRom(headless, Backend::Interpreter));
+				if (!writeFile(goldenPath, image)) {
+					return 1;
+				}
+				printf("Wrote %s\n", goldenPath.c_str());
+				continue;
+			}
+
+			std::string golden;
+			if (!readFile(goldenPath, golden)) {
+				printf("%-24s no golden image at %s\n", rom.filename().string().c_str(), goldenPath.c_str());
+				failed++;
+				continue;
+			}
+
+			for (auto backend : { Backend::Interpreter, Backend::CachedInterpreter, Backend::Dynarec, Backend::AOT }) {
+				clock::duration elapsed = {};
+				const auto core = runRom(headless, backend, &elapsed);
+				const auto image = render(*core);
+				const auto pass = image == golden;
+
+				printf("%-24s %-17s %s | %.3f ms, pc 0x%04X\n", rom.filename().string().c_str(), backendName(backend),
+					pass ? "pass" : "FAIL", std::chrono::duration<double, std::milli>(elapsed).count(), core->pc);
+				if (!pass) {
+					printf("%s", image.c_str());
+					failed++;
+				}
+			}
+		}
+
+		if (!config.bless) {
+			failed += checkBigBlocks(headless);
+			printf("%d run%s failed\n", failed, failed == 1 ? "" : "s");
+		}
+		return failed ? 1 : 0;
+	}
+
+	// The visible screen a row per line, '.' for off and '#', '+' or '@' for plane 0, plane 1 or both
+	static std::string render(const Chip8& core) {
+		static constexpr char pixels[1 << DISPLAY_PLANES] = { '.', '#', '+', '@' };
+		const auto width = core.hires ? HIRES_WIDTH : WIDTH;
+		const auto height = core.hires ? HIRES_HEIGHT : HEIGHT;
+
+		std::string image;
+		for (auto y = 0; y < height; y++) {
+			const auto line = &core.display[y * 2];
+			for (auto x = 0; x < width; x++) {
+				auto colour = 0;
+				for (auto plane = 0; plane < DISPLAY_PLANES; plane++) {
+					colour |= ((line[plane * PLANE_WORDS + (x >> 6)] >> (63 - (x & 63))) & 1) << plane;
+				}
+				image += pixels[colour];
+			}
+			image += '\n';
+		}
+		return image;
+	}
+
+private:
+	// Pages of back-to-back 16x16 draws on both planes, each page a block of the most code a block can lower to.
+	// Compiling them on the recompilers at every SIMD level the host has keeps crossing code cache chunk
+	// boundaries, which has to grow the cache rather than overrun it. The screens are checked against the
+	// interpreter's. Returns how many runs failed
+	static int checkBigBlocks(Config config) {
+		static constexpr uint16_t firstPage = 0x220;
+		static constexpr int pages = 8;
+
+		std::vector<uint16_t> words = { 0x00FF, 0xF301, 0x6113, 0x6207, 0x1000 | firstPage }; // hires, both planes
+		words.resize((firstPage - 0x200) / 2, 0x8000);
+		for (auto page = 0; page < pages; page++) {
+			words.insert(words.end(), pageSize / 2 - 1, 0xD120); // sprites come from the font at I = 0
+			words.push_back(0x1000 | (page + 1 < pages ? firstPage + (page + 1) * pageSize : firstPage));
+		}
+
+		std::vector<uint8_t> program;
+		for (const auto word : words) {
+			program.push_back(word >> 8);
+			program.push_back(word & 0xff);
+		}
+
+		config.romPath = nullptr;
+		const auto run = [&](Backend backend, SimdLevel simd) {
+			config.backend = Backend::Interpreter; // no recompiler until the program's in
+			config.maxSimd = simd;
+			auto core = std::make_unique<Chip8>(nullptr, config);
+			core->loadProgram(program.data(), program.size());
+			core->initBackend(backend);
+
+			auto dispatches = 0;
+			for (auto ran = 0; ran < cycles; ) {
+				ran += core->emulateFrame(config.speed / 60, false, dispatches);
+			}
+			return render(*core);
+		};
+
+		const auto expected = run(Backend::Interpreter, SimdLevel::SSE2);
+		auto failed = 0;
+		for (auto simd : { SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512 }) {
+			if (simd > HostCpu::get().simd) {
+				break;
+			}
+
+			for (auto backend : { Backend::Dynarec, Backend::AOT }) {
+				const auto pass = run(backend, simd) == expected;
+				printf("%-24s %-17s %s | %s\n", "big blocks", backendName(backend), pass ? "pass" : "FAIL", simdName(simd));
+				failed += !pass;
+			}
+		}
+		return failed;
+	}
+
+	// A frame's worth of cycles at a time, so timers tick like they do in the window
+	static std::unique_ptr<Chip8> runRom(Config config, Backend backend, clock::duration* elapsed = nullptr) {
+		config.backend = backend;
+		auto core = std::make_unique<Chip8>(nullptr, config);
+
+		const auto start = clock::now();
+		auto dispatches = 0;
+		for (auto ran = 0; ran < cycles; ) {
+			ran += core->emulateFrame(config.speed / 60, false, dispatches);
+		}
+		if (elapsed) {
+			*elapsed = clock::now() - start;
+		}
+		return core;
+	}
+
+	static bool readFile(const std::string& path, std::string& contents) {
+		FILE* file = fopen(path.c_str(), "rb");
+		if (!file) {
+			return false;
+		}
+
+		char buffer[4096];
+		size_t read;
+		contents.clear();
+		while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+			contents.append(buffer, read);
+		}
+		fclose(file);
+		contents.erase(std::remove(contents.begin(), contents.end(), '\r'), contents.end()); // in case git made it CRLF
+		return true;
+	}
+
+	static bool writeFile(const std::string& path, const std::string& contents) {
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file) {
+			printf("Couldn't open %s\n", path.c_str());
+			return false;
+		}
+
+		fwrite(contents.data(), 1, contents.size(), file);
+		fclose(file);
+		return true;
+	}
+};
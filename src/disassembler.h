@@ -0,0 +1,186 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <iterator>
+#include <string>
+#include <utility>
+
+#define getidentifier(op) (((op) & 0xf000) >> 12)
+#define getaddr(op) ((op) & 0xfff)
+#define getkk(op) ((op) & 0xff)
+#define getx(op) (((op) & 0x0f00) >> 8)
+#define gety(op) (((op) & 0x00f0) >> 4)
+#define getn(op) (((op) & 0x000f) >> 0)
+
+// Turns chip8 instructions back into (Cowgod style) assembly for reports and dumps
+class Chip8Disassembler {
+public:
+	// Generic form of an instruction, eg. "LD Vx, byte". Used to bucket opcode histograms
+	static const char* opcodeClass(uint16_t instr) {
+		switch (getidentifier(instr)) {
+		case 0x0:
+			switch (getaddr(instr)) {
+			case 0x0E0: return "CLS";
+			case 0x0EE: return "RET";
+			case 0x0FB: return "SCR";
+			case 0x0FC: return "SCL";
+			case 0x0FE: return "LOW";
+			case 0x0FF: return "HIGH";
+			default:    return (getaddr(instr) & 0xff0) == 0x0C0 ? "SCD n" : "???";
+			}
+		case 0x1: return "JP addr";
+		case 0x2: return "CALL addr";
+		case 0x3: return "SE Vx, byte";
+		case 0x4: return "SNE Vx, byte";
+		case 0x5:
+			switch (getn(instr)) {
+			case 0x0: return "SE Vx, Vy";
+			case 0x2: return "SAVE Vx, Vy";
+			case 0x3: return "LOAD Vx, Vy";
+			default:  return "???";
+			}
+		case 0x6: return "LD Vx, byte";
+		case 0x7: return "ADD Vx, byte";
+		case 0x8:
+			switch (getn(instr)) {
+			case 0x0: return "LD Vx, Vy";
+			case 0x1: return "OR Vx, Vy";
+			case 0x2: return "AND Vx, Vy";
+			case 0x3: return "XOR Vx, Vy";
+			case 0x4: return "ADD Vx, Vy";
+			case 0x5: return "SUB Vx, Vy";
+			case 0x6: return "SHR Vx, Vy";
+			case 0x7: return "SUBN Vx, Vy";
+			case 0xE: return "SHL Vx, Vy";
+			default:  return "???";
+			}
+		case 0x9: return "SNE Vx, Vy";
+		case 0xA: return "LD I, addr";
+		case 0xB: return "JP V0, addr";
+		case 0xC: return "RND Vx, byte";
+		case 0xD: return "DRW Vx, Vy, n";
+		case 0xE:
+			switch (getkk(instr)) {
+			case 0x9E: return "SKP Vx";
+			case 0xA1: return "SKNP Vx";
+			default:   return "???";
+			}
+		case 0xF:
+			switch (getkk(instr)) {
+			case 0x00: return instr == 0xF000 ? "LD I, long" : "???";
+			case 0x01: return "PLANE n";
+			case 0x07: return "LD Vx, DT";
+			case 0x0A: return "LD Vx, K";
+			case 0x15: return "LD DT, Vx";
+			case 0x18: return "LD ST, Vx";
+			case 0x1E: return "ADD I, Vx";
+			case 0x29: return "LD F, Vx";
+			case 0x33: return "LD B, Vx";
+			case 0x55: return "LD [I], Vx";
+			case 0x65: return "LD Vx, [I]";
+			default:   return "???";
+			}
+		}
+
+		return "???";
+	}
+
+	// Instruction with its operands filled in, eg. "LD V3, 0x2A"
+	static std::string disassemble(uint16_t instr) {
+		char buffer[32];
+		const auto x = getx(instr);
+		const auto y = gety(instr);
+
+		switch (getidentifier(instr)) {
+		case 0x1: snprintf(buffer, sizeof(buffer), "JP 0x%03X", getaddr(instr));                 break;
+		case 0x2: snprintf(buffer, sizeof(buffer), "CALL 0x%03X", getaddr(instr));               break;
+		case 0x3: snprintf(buffer, sizeof(buffer), "SE V%X, 0x%02X", x, getkk(instr));           break;
+		case 0x4: snprintf(buffer, sizeof(buffer), "SNE V%X, 0x%02X", x, getkk(instr));          break;
+		case 0x6: snprintf(buffer, sizeof(buffer), "LD V%X, 0x%02X", x, getkk(instr));           break;
+		case 0x7: snprintf(buffer, sizeof(buffer), "ADD V%X, 0x%02X", x, getkk(instr));          break;
+		case 0x9: snprintf(buffer, sizeof(buffer), "SNE V%X, V%X", x, y);                        break;
+		case 0xA: snprintf(buffer, sizeof(buffer), "LD I, 0x%03X", getaddr(instr));              break;
+		case 0xB: snprintf(buffer, sizeof(buffer), "JP V0, 0x%03X", getaddr(instr));             break;
+		case 0xC: snprintf(buffer, sizeof(buffer), "RND V%X, 0x%02X", x, getkk(instr));          break;
+		case 0xD: snprintf(buffer, sizeof(buffer), "DRW V%X, V%X, %d", x, y, getn(instr));       break;
+		case 0x0:
+			if ((getaddr(instr) & 0xff0) == 0x0C0) {
+				snprintf(buffer, sizeof(buffer), "SCD %d", getn(instr));
+				break;
+			}
+			return plainForm(instr);
+		case 0x5:
+		case 0x8: {
+			// Same operand shape for every 5xyn and 8xyn, so just splice the mnemonic in
+			std::string mnemonic = opcodeClass(instr);
+			if (mnemonic == "???") {
+				snprintf(buffer, sizeof(buffer), "??? 0x%04X", instr);
+			} else {
+				snprintf(buffer, sizeof(buffer), "%s V%X, V%X", mnemonic.substr(0, mnemonic.find(' ')).c_str(), x, y);
+			}
+			break;
+		}
+		case 0xF:
+			if ((instr & 0xff) == 0x01) {
+				snprintf(buffer, sizeof(buffer), "PLANE %d", x);
+				break;
+			}
+			return plainForm(instr);
+		default:
+			return plainForm(instr);
+		}
+
+		return buffer;
+	}
+
+	// Checks disassemble against known encodings (--check-disassembler, run by ctest). Process exit code, non zero
+	// if any came out wrong
+	static int check() {
+		static const std::pair<uint16_t, const char*> expected[] = {
+			{ 0x00E0, "CLS" },
+			{ 0x00EE, "RET" },
+			{ 0x00C5, "SCD 5" },
+			{ 0x00FB, "SCR" },
+			{ 0x00FC, "SCL" },
+			{ 0x00FE, "LOW" },
+			{ 0x00FF, "HIGH" },
+			{ 0x0123, "??? 0x0123" },
+			{ 0x1234, "JP 0x234" },
+			{ 0x5122, "SAVE V1, V2" },
+			{ 0x8AB4, "ADD VA, VB" },
+			{ 0xD12F, "DRW V1, V2, 15" },
+			{ 0xF000, "LD I, long" },
+			{ 0xF201, "PLANE 2" },
+			{ 0xF333, "LD B, V3" },
+		};
+
+		auto failed = 0;
+		for (const auto& [instr, text] : expected) {
+			const auto got = disassemble(instr);
+			if (got != text) {
+				printf("%04X disassembled as \"%s\", expected \"%s\"\n", instr, got.c_str(), text);
+				failed++;
+			}
+		}
+		printf("%d of %d instructions disassembled wrong\n", failed, (int)std::size(expected));
+		return failed ? 1 : 0;
+	}
+
+private:
+	// Operand-less, or only Vx, so substitute the x into the generic form
+	static std::string plainForm(uint16_t instr) {
+		std::string form = opcodeClass(instr);
+		if (form == "???") {
+			char buffer[16];
+			snprintf(buffer, sizeof(buffer), "??? 0x%04X", instr);
+			return buffer;
+		}
+
+		if (const auto pos = form.find("Vx"); pos != std::string::npos) {
+			char reg[4];
+			snprintf(reg, sizeof(reg), "V%X", getx(instr));
+			form.replace(pos, 2, reg);
+		}
+		return form;
+	}
+};
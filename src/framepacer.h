@@ -0,0 +1,146 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <timeapi.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Paces the emu thread against absolute deadlines on a monotonic clock.
+// Sleeping alone overshoots by up to a scheduler tick, spinning alone burns a core,
+// so we sleep until shortly before the deadline and spin the remaining bit.
+class FramePacer {
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct JitterReport {
+		double p50 = 0;
+		double p90 = 0;
+		double p99 = 0;
+		double max = 0;
+		size_t frames = 0;
+	};
+
+	FramePacer(double rate) {
+#ifdef _WIN32
+		timeBeginPeriod(1); //default timer resolution is ~15.6ms, which is useless for pacing
+#endif
+		setRate(rate);
+		frameTimes.reserve(1024);
+	}
+
+	~FramePacer() {
+#ifdef _WIN32
+		timeEndPeriod(1);
+#endif
+	}
+
+	void setRate(double rate) {
+		period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / rate));
+		reset();
+	}
+
+	// Restart the schedule from now, eg. after the frame limiter was off for a while
+	void reset() {
+		deadline = clock::now() + period;
+		lastFrame = clock::now();
+	}
+
+	// Block until the next frame deadline
+	void wait() {
+		auto now = clock::now();
+
+		// If we've fallen more than a frame behind, don't try to catch up with a burst of frames
+		if (now > deadline + period) [[unlikely]] {
+			deadline = now;
+		}
+
+		if (deadline - now > spinThreshold) {
+			std::this_thread::sleep_until(deadline - spinThreshold);
+
+			// Track how late the os wakes us up, and spin for a bit more than that next time
+			const auto overshoot = clock::now() - (deadline - spinThreshold);
+			spinThreshold = std::clamp((spinThreshold * 6 + (overshoot + minSpin) * 2) / 8, minSpin, maxSpin);
+		}
+
+		while (clock::now() < deadline) {
+			spinPause();
+		}
+
+		deadline += period;
+	}
+
+	// Sample the time since the previous frame, call once per frame
+	void recordFrame() {
+		const auto now = clock::now();
+		frameTimes.push_back(std::chrono::duration<double, std::milli>(now - lastFrame).count());
+		lastFrame = now;
+	}
+
+	// Frame time percentiles in milliseconds since the last report
+	JitterReport report() {
+		JitterReport report;
+		if (frameTimes.empty()) {
+			return report;
+		}
+
+		std::sort(frameTimes.begin(), frameTimes.end());
+		const auto percentile = [this](double p) {
+			return frameTimes[(size_t)(p * (frameTimes.size() - 1))];
+		};
+
+		report.p50 = percentile(0.5);
+		report.p90 = percentile(0.9);
+		report.p99 = percentile(0.99);
+		report.max = frameTimes.back();
+		report.frames = frameTimes.size();
+		frameTimes.clear();
+
+		return report;
+	}
+
+	// Pin the calling thread to a single cpu, returns false if unsupported or it failed
+	static bool pinCurrentThread(int cpu) {
+#ifdef _WIN32
+		return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
+private:
+	static constexpr clock::duration minSpin = std::chrono::microseconds(200);
+	static constexpr clock::duration maxSpin = std::chrono::milliseconds(4);
+
+	clock::duration period;
+	clock::time_point deadline;
+	clock::time_point lastFrame;
+	clock::duration spinThreshold = std::chrono::milliseconds(1);
+
+	std::vector<double> frameTimes; //ms
+
+	static void spinPause() {
+#if defined(_M_X64) || defined(__x86_64__)
+		_mm_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+};
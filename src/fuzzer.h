@@ -0,0 +1,387 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chip8.h>
+#include <config.h>
+#include <disassembler.h>
+#include <jitcommon.h>
+
+// Random bytes for the program generator, read from a libFuzzer input, or from a xorshift when there's none
+// (or it's used up) so standalone runs reproduce from a seed
+class ByteSource {
+public:
+	explicit ByteSource(uint32_t seed) : rng(seed | 1) {}
+	ByteSource(const uint8_t* data, size_t size) : data(data), size(size), rng(0x2545f491) {}
+
+	uint8_t byte() {
+		if (pos < size) {
+			return data[pos++];
+		}
+
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		return rng >> 24;
+	}
+
+	uint16_t word() {
+		return (uint16_t)(byte() << 8 | byte());
+	}
+
+	// Evenly enough spread over [0, range)
+	uint32_t below(uint32_t range) {
+		return word() % range;
+	}
+
+private:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+	size_t pos = 0;
+	uint32_t rng;
+};
+
+// A random but well behaved program: jumps and calls land on instructions, I points at data rather than code, and
+// everything that runs off the end lands in a sled that jumps to a halt. Bnnn always jumps into the sled, as Vx can
+// make it land on any byte
+struct FuzzProgram {
+	static constexpr int haltIndex = 9;                   // word 0x212 is "JP 0x212"
+	static constexpr uint8_t sledByte = 0x12;             // 0x1212 from any byte in the sled is "JP 0x212"
+	static constexpr int sledSize = 0x100 + 2;            // Bnnn can add up to 0xFF
+	static constexpr uint16_t nop = 0x8000;               // LD V0, V0, takes a cycle and does nothing
+
+	std::vector<uint16_t> words;
+	std::vector<uint16_t> starts; // word index of every instruction, the second word of F000 nnnn isn't one
+	uint8_t keys = 0;             // low byte of the keypad state, the high keys stay up
+	bool blockStep = true;        // compare after every block, otherwise let linked blocks run a few at a time
+
+	static uint16_t address(size_t wordIndex) {
+		return (uint16_t)(0x200 + wordIndex * 2);
+	}
+
+	uint16_t end() const {
+		return address(words.size());
+	}
+
+	std::vector<uint8_t> rom() const {
+		std::vector<uint8_t> bytes;
+		for (const auto word : words) {
+			bytes.push_back(word >> 8);
+			bytes.push_back(word & 0xff);
+		}
+		bytes.insert(bytes.end(), sledSize, sledByte);
+		return bytes;
+	}
+
+	static FuzzProgram generate(ByteSource& source) {
+		FuzzProgram program;
+		const auto length = 16 + source.below(112);
+		program.keys = source.byte() & 1 ? source.byte() : 0;
+		program.blockStep = source.byte() & 1;
+
+		// Lay out instructions first, so jumps can pick targets ahead of them
+		std::vector<bool> isLong;
+		for (size_t i = 0; i < length; i++) {
+			program.starts.push_back((uint16_t)i);
+			if (i + 1 < length && i + 1 != haltIndex && i != haltIndex && source.below(16) == 0) {
+				isLong.push_back(true);
+				i++;
+			} else {
+				isLong.push_back(false);
+			}
+		}
+		program.words.resize(length);
+
+		for (size_t n = 0; n < program.starts.size(); n++) {
+			const auto i = program.starts[n];
+			if (i == haltIndex) {
+				program.words[i] = 0x1000 | address(haltIndex);
+			} else if (isLong[n]) {
+				program.words[i] = 0xF000;
+				program.words[i + 1] = (uint16_t)(0x800 + source.below(0x10000 - 0x800));
+			} else {
+				program.words[i] = instruction(source, program);
+			}
+		}
+
+		return program;
+	}
+
+	// Anything but F000 nnnn, with operands kept in bounds
+	static uint16_t instruction(ByteSource& source, const FuzzProgram& program) {
+		const auto x = source.below(16);
+		const auto y = source.below(16);
+		const auto kk = source.byte();
+		const auto target = [&] {
+			return address(program.starts[source.below((uint32_t)program.starts.size())]);
+		};
+
+		switch (source.below(36)) {
+		case 0:  return 0x00E0;
+		case 1:  return 0x00EE;
+		case 2:  return 0x00C0 | (kk & 0xf);
+		case 3:  return 0x00FB;
+		case 4:  return 0x00FC;
+		case 5:  return kk & 1 ? 0x00FF : 0x00FE;
+		case 6:  return 0x1000 | target();
+		case 7:  return 0x2000 | target();
+		case 8:  return 0x3000 | x << 8 | kk;
+		case 9:  return 0x4000 | x << 8 | kk;
+		case 10: return 0x5000 | x << 8 | y << 4;
+		case 11: return 0x5002 | x << 8 | y << 4;
+		case 12: return 0x5003 | x << 8 | y << 4;
+		case 13:
+		case 14: return 0x6000 | x << 8 | kk;
+		case 15:
+		case 16: return 0x7000 | x << 8 | kk;
+		case 17:
+		case 18:
+		case 19: {
+			static constexpr uint16_t alu[] = { 0, 1, 2, 3, 4, 5, 6, 7, 0xE };
+			return 0x8000 | x << 8 | y << 4 | alu[kk % 9];
+		}
+		case 20: return 0x9000 | x << 8 | y << 4;
+		case 21: return 0xA000 | (0x800 + source.below(0x800));
+		case 22: return 0xB000 | (program.end() + source.below(2));
+		case 23: return 0xC000 | x << 8 | kk;
+		case 24:
+		case 25: return 0xD000 | x << 8 | y << 4 | (kk & 0xf);
+		case 26: return 0xE09E | x << 8;
+		case 27: return 0xE0A1 | x << 8;
+		case 28: return 0xF001 | (kk & 3) << 8;
+		case 29: return 0xF007 | x << 8;
+		case 30: return (kk & 7 ? 0xF015 : 0xF00A) | x << 8; // mostly DT, as Fx0A spins while no key is held
+		case 31: return 0xF018 | x << 8;
+		case 32: return 0xF01E | x << 8;
+		case 33: return 0xF029 | x << 8;
+		case 34: return 0xF033 | x << 8;
+		default: return (kk & 1 ? 0xF055 : 0xF065) | x << 8;
+		}
+	}
+};
+
+// Differential testing (--fuzz <programs>): random programs run on the interpreter and on a recompiler (--backend)
+// in lockstep, and after every dispatch the whole architectural state has to match. A program that makes them
+// disagree is minimized by swapping instructions for nops while it still does, and reported with the fields that
+// differ. With -DJIT8_LIBFUZZER the same check runs on libFuzzer's inputs instead, see main.cpp
+class Fuzzer {
+public:
+	static constexpr int cycles = 1000;           // per program
+	static constexpr int cyclesPerTick = 600 / 60; // timers tick as if running at the default speed
+	inline static SimdLevel simd = SimdLevel::AVX512; // what the recompilers may use, --simd
+
+	// Process exit code, non zero if a program diverged
+	static int run(const Config& config) {
+		const auto backend = config.backend == Backend::Interpreter ? Backend::Dynarec : config.backend;
+		auto seed = config.seed ? config.seed : 1;
+		simd = HostCpu::level(config.maxSimd);
+		printf("Fuzzing %s (%s) against the interpreter with %d programs, seed 0x%08X\n", backendName(backend),
+			simdName(simd), config.fuzzPrograms, seed);
+
+		for (auto i = 0; i < config.fuzzPrograms; i++) {
+			ByteSource source(seed);
+			const auto program = FuzzProgram::generate(source);
+			if (!check(program, backend)) {
+				printf("Program %d (--fuzz 1 --seed 0x%08X --simd %s) diverged\n", i, seed, simdName(simd));
+				return 1;
+			}
+
+			seed = nextSeed(seed);
+			if ((i + 1) % 1000 == 0) {
+				printf("%d programs, no divergence\n", i + 1);
+			}
+		}
+
+		printf("All %d programs matched\n", config.fuzzPrograms);
+		return 0;
+	}
+
+	// One libFuzzer input, against both recompilers with every SIMD level the host has. Divergence aborts, which is
+	// what libFuzzer is watching for
+	static void runInput(const uint8_t* data, size_t size) {
+		ByteSource source(data, size);
+		const auto program = FuzzProgram::generate(source);
+		for (auto level : { SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512 }) {
+			if (level > HostCpu::get().simd) {
+				break;
+			}
+
+			simd = level;
+			for (auto backend : { Backend::Dynarec, Backend::AOT }) {
+				if (!check(program, backend)) {
+					abort();
+				}
+			}
+		}
+	}
+
+private:
+	struct Divergence {
+		int step = -1; // dispatch the states stopped matching after, -1 if they never did
+		int cycles = 0;
+	};
+
+	static uint32_t nextSeed(uint32_t seed) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+
+	// Runs the program, and if it diverges, minimizes and reports it. True if it didn't
+	static bool check(const FuzzProgram& program, Backend backend) {
+		if (lockstep(program, backend).step < 0) {
+			return true;
+		}
+
+		auto minimized = program;
+		for (auto changed = true; changed; ) {
+			changed = false;
+			for (const auto i : program.starts) { // the layout never changes, only words do
+				if (i == FuzzProgram::haltIndex || minimized.words[i] == FuzzProgram::nop) {
+					continue;
+				}
+
+				auto candidate = minimized;
+				const auto isLong = candidate.words[i] == 0xF000; // only ever generated with its operand
+				candidate.words[i] = FuzzProgram::nop;
+				if (isLong) {
+					candidate.words[i + 1] = FuzzProgram::nop;
+				}
+
+				if (lockstep(candidate, backend).step >= 0) {
+					minimized = candidate;
+					changed = true;
+				}
+			}
+		}
+
+		report(minimized, backend);
+		return false;
+	}
+
+	static std::unique_ptr<Chip8> makeCore(const FuzzProgram& program, Backend backend) {
+		Config config;
+		config.romPath = nullptr;
+		config.backend = Backend::Interpreter; // no recompiler until the program's in
+		config.seed = 0x1234567;
+		config.dumpCode = false;
+		config.maxSimd = simd;
+
+		auto core = std::make_unique<Chip8>(nullptr, config);
+		const auto rom = program.rom();
+		core->loadProgram(rom.data(), rom.size());
+		core->initBackend(backend);
+		core->keyState.store(program.keys, std::memory_order_relaxed);
+		return core;
+	}
+
+	static Divergence lockstep(const FuzzProgram& program, Backend backend,
+		std::unique_ptr<Chip8>* coreOut = nullptr, std::unique_ptr<Chip8>* referenceOut = nullptr) {
+		auto core = makeCore(program, backend);
+		auto reference = makeCore(program, Backend::Interpreter);
+		const auto rom = program.rom();
+		Divergence result;
+
+		ByteSource budget((uint32_t)program.words.size()); // budgets for linked runs, the same every time
+		auto untilTick = cyclesPerTick;
+		for (auto step = 0; result.cycles < cycles; step++) {
+			const auto ran = core->cpuExecuteFunc(*core, program.blockStep ? 1 : 1 + budget.below(32));
+			for (auto i = 0; i < ran; i++) {
+				reference->cpuExecuteFunc(*reference, 1);
+			}
+			result.cycles += ran;
+
+			for (untilTick -= ran; untilTick <= 0; untilTick += cyclesPerTick) {
+				core->tickTimers(false);
+				reference->tickTimers(false);
+			}
+
+			if (!sameState(*core, *reference)) {
+				result.step = step;
+				break;
+			}
+
+			// Stores are kept out of the program, but Fx1E can walk I into it. Stop before anything runs the result
+			if (memcmp(reference->ram.data() + 0x200, rom.data(), rom.size())) {
+				break;
+			}
+		}
+
+		if (coreOut) {
+			*coreOut = std::move(core);
+			*referenceOut = std::move(reference);
+		}
+		return result;
+	}
+
+	static bool sameState(const Chip8& a, const Chip8& b) {
+		return a.pc == b.pc && a.index == b.index && a.sp == b.sp && a.delay == b.delay && a.sound == b.sound &&
+			a.hires == b.hires && a.planes == b.planes && a.rng == b.rng && a.gpr == b.gpr && a.stack == b.stack &&
+			a.display == b.display && a.ram == b.ram;
+	}
+
+	static void report(const FuzzProgram& program, Backend backend) {
+		std::unique_ptr<Chip8> core, reference;
+		const auto divergence = lockstep(program, backend, &core, &reference);
+		printf("%s (%s) diverged from the interpreter after dispatch %d, %d cycles in (%s)\n", backendName(backend),
+			simdName(simd), divergence.step, divergence.cycles, program.blockStep ? "a block per dispatch" : "linked blocks");
+
+		const auto field = [](const char* name, unsigned a, unsigned b) {
+			if (a != b) {
+				printf("  %-12s 0x%04X, interpreter 0x%04X\n", name, a, b);
+			}
+		};
+		field("pc", core->pc, reference->pc);
+		field("I", core->index, reference->index);
+		field("sp", core->sp, reference->sp);
+		field("DT", core->delay, reference->delay);
+		field("ST", core->sound, reference->sound);
+		field("hires", core->hires, reference->hires);
+		field("planes", core->planes, reference->planes);
+		field("rng", core->rng, reference->rng);
+
+		char name[24];
+		for (auto i = 0; i < 16; i++) {
+			snprintf(name, sizeof(name), "V%X", i);
+			field(name, core->gpr[i], reference->gpr[i]);
+			snprintf(name, sizeof(name), "stack[%d]", i);
+			field(name, core->stack[i], reference->stack[i]);
+		}
+
+		auto ramDiffs = 0;
+		for (size_t i = 0; i < core->ram.size(); i++) {
+			if (core->ram[i] != reference->ram[i] && ramDiffs++ < 8) {
+				snprintf(name, sizeof(name), "ram[0x%04zX]", i);
+				field(name, core->ram[i], reference->ram[i]);
+			}
+		}
+		if (ramDiffs > 8) {
+			printf("  ...and %d more bytes of ram\n", ramDiffs - 8);
+		}
+
+		for (size_t i = 0; i < core->display.size(); i++) {
+			if (core->display[i] != reference->display[i]) {
+				printf("  plane %zu, row %zu, %s word\n", i / PLANE_WORDS, i % PLANE_WORDS / 2, i & 1 ? "right" : "left");
+			}
+		}
+
+		printf("Minimized program, keys 0x%02X, nops left out:\n", program.keys);
+		for (size_t n = 0; n < program.starts.size(); n++) {
+			const auto i = program.starts[n];
+			const auto instr = program.words[i];
+			if (instr == FuzzProgram::nop) {
+				continue;
+			}
+
+			if (instr == 0xF000 && n + 1 < program.starts.size() && program.starts[n + 1] == i + 2) {
+				printf("  0x%04X  F000 %04X  LD I, long 0x%04X\n", FuzzProgram::address(i), program.words[i + 1],
+					program.words[i + 1]);
+			} else {
+				printf("  0x%04X  %04X       %s\n", FuzzProgram::address(i), instr, Chip8Disassembler::disassemble(instr).c_str());
+			}
+		}
+	}
+};
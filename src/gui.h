@@ -1,6 +1,7 @@
 #pragma once
 #include <math.h>
-#include <unordered_map>
+#include <algorithm>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -8,30 +9,25 @@
 #include <SFML/Graphics/RenderWindow.hpp>
 #include <SFML/Graphics/Texture.hpp>
 #include <SFML/Graphics/Sprite.hpp>
-#include <SFML/Audio/Sound.hpp>
-#include <SFML/Audio/SoundBuffer.hpp>
 #include <chip8.h>
+#include <config.h>
+#include <audio.h>
+#include <savestate.h>
 
-static constexpr int SAMPLES = 44100;
-static constexpr int SAMPLERATE = 44100;
-
-//TODO: sound, debug only stuff, cl arguments and cleanup
+//TODO: debug only stuff and cleanup
 class GUI {
 private:
 	// rendering
 	sf::Texture texture;
 	sf::Sprite sprite;
-	std::array<uint32_t, WIDTH * HEIGHT> framebuffer;
-
-	// audio
-	sf::Sound sound;
-	sf::SoundBuffer soundBuffer;
-	std::array<int16_t, SAMPLES> rawBuffer;
-	uint32_t amplitude;
+	std::array<uint32_t, HIRES_WIDTH * HIRES_HEIGHT> framebuffer; // lores pixels are drawn 2x2
 
 	// chip8 and threading
 	std::thread emu_thread;
 	Chip8 core;
+
+	// audio
+	ToneStream tone;
 public:
 	sf::RenderWindow window;
 
@@ -46,7 +42,8 @@ public:
 	std::mutex mRunFrame;
 	std::condition_variable cvRunFrame;
 
-	GUI() : window(sf::VideoMode(640, 320), "JIT8"), core(this, 600) {
+	GUI(const Config& config) : window(sf::VideoMode(640, 320), "JIT8"), core(this, config),
+		tone(core.soundTimeline, config.speed, config.muteFastForward) {
 		emu_thread = std::thread([this]() {
 			core.runFrame();
 			});
@@ -54,16 +51,14 @@ public:
 		//emu_thread.detach(); //fly free, emu thread... 
 
 		runFrame = false;
-		window.setFramerateLimit(60);
 		window.setTitle("JIT8 | FPS: " + std::to_string(60));
 
 		//Initialise SFML stuff
-		texture.create(64, 32);
+		texture.create(HIRES_WIDTH, HIRES_HEIGHT);
 		sprite.setTexture(texture);
-		sprite.setScale(sf::Vector2f(10, 10));
-		initAudio();
+		sprite.setScale(sf::Vector2f(5, 5));
 		framebuffer.fill(0);
-		rawBuffer.fill(0);
+		tone.play(); // streams for the whole session, the sound timer only gates the tone
 	}
 
 	~GUI() = default;
@@ -82,20 +77,22 @@ public:
 	}
 
 	void run() {
+		using clock = std::chrono::steady_clock;
+		constexpr auto renderPeriod = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / 60));
+		auto nextRender = clock::now();
+
 		while (window.isOpen()) {
 			//pingEmuthread();
 
+			// Input is polled at ~1khz rather than once per rendered frame, so key latency doesn't depend on the frame rate
 			handleInput();
 
-			// Handle timers
-			if (core.delay) --core.delay;
-			if (core.sound) {
-				sound.play();
-				--core.sound;
-				if (!core.sound) {
-					sound.pause();
-				}
+			const auto now = clock::now();
+			if (now < nextRender) {
+				sf::sleep(sf::milliseconds(1));
+				continue;
 			}
+			nextRender = std::max(nextRender + renderPeriod, now); // don't burst frames if we fell behind
 
 			//Draw framebuffer to screen
 			drawToFramebuffer();
@@ -110,40 +107,61 @@ public:
 		emu_thread.join();
 	}
 
+	// Plain chip8 and SCHIP only ever touch the first plane, so they still come out black and white
+	static constexpr std::array<uint32_t, 1 << DISPLAY_PLANES> palette = {
+		0,          // off
+		0xffffffff, // plane 0
+		0xffaaaaaa, // plane 1
+		0xff555555, // both
+	};
+
 	void drawToFramebuffer() {
-		for (auto i = 0; i < HEIGHT; i++) {
-			const auto line = core.display[i];
-			for (auto j = 0; j < WIDTH; j++) {
-				const auto bit = (line >> (63 - j)) & 1;
-				if (bit) {
-					framebuffer[j + i * WIDTH] = 0xffffffff;
-				} else {
-					framebuffer[j + i * WIDTH] = 0;
+		std::lock_guard<std::mutex> lock(core.presentLock);
+		const auto scale = core.presentedHires ? 1 : 2;
+		for (auto i = 0; i < HIRES_HEIGHT; i++) {
+			const auto line = &core.presentedDisplay[(i / scale) * 2];
+			for (auto j = 0; j < HIRES_WIDTH; j++) {
+				const auto x = j / scale;
+				auto colour = 0;
+				for (auto plane = 0; plane < DISPLAY_PLANES; plane++) {
+					colour |= ((line[plane * PLANE_WORDS + (x >> 6)] >> (63 - (x & 63))) & 1) << plane;
 				}
+				framebuffer[j + i * HIRES_WIDTH] = palette[colour];
 			}
 		}
 	}
 
-	void handleInput() {
-		static std::unordered_map <sf::Keyboard::Key, int> keyMappings = {
-		   {sf::Keyboard::Num1, 0x1},
-		   {sf::Keyboard::Num2, 0x2},
-		   {sf::Keyboard::Num3, 0x3},
-		   {sf::Keyboard::Num4, 0xC},
-		   {sf::Keyboard::Q, 0x4},
-		   {sf::Keyboard::W, 0x5},
-		   {sf::Keyboard::E, 0x6},
-		   {sf::Keyboard::R, 0xD},
-		   {sf::Keyboard::A, 0x7},
-		   {sf::Keyboard::S, 0x8},
-		   {sf::Keyboard::D, 0x9},
-		   {sf::Keyboard::F, 0xE},
-		   {sf::Keyboard::Z, 0xA},
-		   {sf::Keyboard::X, 0x0},
-		   {sf::Keyboard::C, 0xB},
-		   {sf::Keyboard::V, 0xF},
-		};
+	// Maps every sf::Keyboard::Key to a chip8 key, or -1 if it isn't mapped
+	static constexpr auto keyMappings = [] {
+		std::array<int8_t, sf::Keyboard::KeyCount> mappings{};
+		mappings.fill(-1);
+		mappings[sf::Keyboard::Num1] = 0x1;
+		mappings[sf::Keyboard::Num2] = 0x2;
+		mappings[sf::Keyboard::Num3] = 0x3;
+		mappings[sf::Keyboard::Num4] = 0xC;
+		mappings[sf::Keyboard::Q] = 0x4;
+		mappings[sf::Keyboard::W] = 0x5;
+		mappings[sf::Keyboard::E] = 0x6;
+		mappings[sf::Keyboard::R] = 0xD;
+		mappings[sf::Keyboard::A] = 0x7;
+		mappings[sf::Keyboard::S] = 0x8;
+		mappings[sf::Keyboard::D] = 0x9;
+		mappings[sf::Keyboard::F] = 0xE;
+		mappings[sf::Keyboard::Z] = 0xA;
+		mappings[sf::Keyboard::X] = 0x0;
+		mappings[sf::Keyboard::C] = 0xB;
+		mappings[sf::Keyboard::V] = 0xF;
+		return mappings;
+	}();
+
+	static int mapKey(sf::Keyboard::Key key) {
+		if (key < 0 || key >= sf::Keyboard::KeyCount) {
+			return -1;
+		}
+		return keyMappings[key];
+	}
 
+	void handleInput() {
 		sf::Event event;
 
 		while (window.pollEvent(event)) //Handle input
@@ -156,46 +174,28 @@ public:
 				if (event.key.code == sf::Keyboard::I) {
 					toggleFramelimiter();
 				}
-				core.keyState[keyMappings[event.key.code]] = true;
+				if (event.key.code == sf::Keyboard::F5) {
+					core.stateRequest.store(StateRequest::Save, std::memory_order_relaxed);
+				}
+				if (event.key.code == sf::Keyboard::F8) {
+					core.stateRequest.store(StateRequest::Load, std::memory_order_relaxed);
+				}
+				if (event.key.code == sf::Keyboard::Backspace) {
+					core.rewinding.store(true, std::memory_order_relaxed);
+				}
+				if (const auto key = mapKey(event.key.code); key >= 0) {
+					core.keyState.fetch_or(1 << key, std::memory_order_relaxed);
+				}
 				break;
 			case sf::Event::KeyReleased:
-				core.keyState[keyMappings[event.key.code]] = false;
+				if (event.key.code == sf::Keyboard::Backspace) {
+					core.rewinding.store(false, std::memory_order_relaxed);
+				}
+				if (const auto key = mapKey(event.key.code); key >= 0) {
+					core.keyState.fetch_and(~(1 << key), std::memory_order_relaxed);
+				}
 				break;
 			}
 		}
 	}
-
-	// fills audio buffer with sin wave
-	void initAudio() {
-		//generateSquareWaveSamples();
-		generateSineWaveSamples();
-		soundBuffer.loadFromSamples((sf::Int16*)rawBuffer.data(), SAMPLES, 1, SAMPLERATE);
-		sound.setBuffer(soundBuffer);
-		sound.setLoop(true);
-	}
-	
-	// fills sample buffer with square wave
-	void generateSquareWaveSamples() {
-		constexpr uint32_t amplitude = 30000;              // how loud/quiet the sound is
-		constexpr double twoPI = 6.28318;
-		constexpr double frequency = 440;                  // the pitch of the sound
-		// As I understand it, we need to fit frequency amount of waves inside the 
-		// buffer of size samplerate. So i * increment stretches the wave to accomplish
-		// this.
-		constexpr double increment = frequency/SAMPLERATE;
-		for (auto i = 0; i < SAMPLES; i++) {
-			rawBuffer[i] = amplitude * (sin(i * increment * twoPI) > 0);
-		}
-	}
-
-	// fills sample buffer with sine wave
-	void generateSineWaveSamples() {
-		constexpr uint32_t amplitude = 30000;
-		constexpr double twoPI = 6.28318;
-		constexpr double frequency = 440;
-		constexpr double increment = frequency/SAMPLERATE;
-		for (unsigned i = 0; i < SAMPLES; i++) {
-			rawBuffer[i] = amplitude * sin(i * increment * twoPI);
-		}
-	}
 };
\ No newline at end of file
@@ -0,0 +1,320 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <stdlib.h>
+#include <vector>
+#include <stdint.h>
+#include <chip8.h>
+#include <jitcommon.h>
+
+#define getidentifier(op) (((op) & 0xf000) >> 12)
+#define getaddr(op) ((op) & 0xfff)
+#define getkk(op) ((op) & 0xff)
+#define getx(op) (((op) & 0x0f00) >> 8)
+#define gety(op) (((op) & 0x00f0) >> 4)
+#define getn(op) (((op) & 0x000f) >> 0)
+
+class Chip8;
+
+// A small typed IR shared by the recompilers. The decoder turns a guest block into a straight line of IR
+// instructions ending in exactly one terminator, passes rewrite it, and X64Lowering turns it into host code.
+enum class IROp : uint8_t {
+	// Guest registers
+	LoadImm,     // Vx = imm
+	Copy,        // Vx = Vy
+	AddImm,      // Vx += imm, VF untouched
+	Alu,         // Vx = Vx <alu> Vy, then VF = flag if writesFlag
+	Rand,        // Vx = random byte & imm
+
+	// Index register
+	SetIndex,    // I = imm, Annn or F000 nnnn
+	AddIndex,    // I += Vx
+	FontIndex,   // I = Vx * 5
+
+	// Timers
+	ReadDelay,   // Vx = DT
+	WriteDelay,  // DT = Vx
+	WriteSound,  // ST = Vx
+
+	// Memory
+	StoreBCD,    // ram[I..I+2] = bcd(Vx)
+	StoreRegs,   // ram[I..] = Vx..Vy, backwards if x > y
+	LoadRegs,    // Vx..Vy = ram[I..], backwards if x > y
+	Invalidate,  // throw out compiled blocks overlapping ram[I..I+imm)
+
+	// Display
+	Clear,
+	Draw,        // Dxyn (imm = n, 0 for a 16x16 sprite), then VF = collision if writesFlag
+	DrawConst,   // Draw with Vx = x, Vy = y and I = imm known when compiled, sub = n
+	Scroll,      // scroll the screen imm pixels in direction sub
+	SetMode,     // hires = imm, clears every plane
+	SetPlanes,   // planes = imm, which bitplanes Clear, Draw and Scroll act on
+
+	// Terminators, one at the end of every block. "next" is the block's endPC
+	Jump,        // pc = imm
+	JumpV0,      // pc = V0 + imm
+	Call,        // push next, pc = imm
+	Return,      // pc = pop
+	Skip,        // pc = cond ? skipPC : next, imm is the byte EqImm/NeImm compare against
+	WaitKey,     // if a key is held Vx = lowest held key and pc = next, otherwise stay on this instruction
+	FallThrough, // pc = next
+	Invalid,     // unimplemented instruction imm, the helper reports it and exits
+};
+
+enum class AluOp : uint8_t {
+	Or,
+	And,
+	Xor,
+	Add,  // VF = carry
+	Sub,  // VF = Vx > Vy
+	SubN, // Vx = Vy - Vx, VF = Vy > Vx
+	Shr,  // Vx >>= 1, VF = shifted out bit
+	Shl,  // Vx <<= 1, VF = shifted out bit
+};
+
+enum class ScrollDir : uint8_t {
+	Down,  // 00Cn
+	Right, // 00FB
+	Left,  // 00FC
+};
+
+enum class Cond : uint8_t {
+	EqImm,   // Vx == imm
+	NeImm,   // Vx != imm
+	EqReg,   // Vx == Vy
+	NeReg,   // Vx != Vy
+	KeyDown, // key Vx is held
+	KeyUp,   // key Vx isn't held
+};
+
+struct IRInst {
+	IROp op;
+	uint8_t x = 0;
+	uint8_t y = 0;
+	uint8_t sub = 0;   // AluOp, Cond, ScrollDir or DrawConst's n
+	uint16_t imm = 0;
+	bool writesFlag = false; // Alu and Draw, cleared by dead flag elimination
+	uint8_t guestIndex = 0;  // which of the block's guest instructions this came from
+
+	bool isTerminator() const {
+		return op >= IROp::Jump;
+	}
+
+	// Vx through Vy as a bitmask, either way round
+	uint16_t regRange() const {
+		const auto low = std::min(x, y);
+		const auto high = std::max(x, y);
+		return (uint16_t)(((2 << high) - 1) & ~((1 << low) - 1));
+	}
+
+	// Guest registers read and written, as bitmasks of V0-VF
+	uint16_t reads() const {
+		const uint16_t vx = 1 << x;
+		const uint16_t vy = 1 << y;
+
+		switch (op) {
+		case IROp::Copy:      return vy;
+		case IROp::AddImm:    return vx;
+		case IROp::Alu:       return (AluOp)sub == AluOp::Shr || (AluOp)sub == AluOp::Shl ? vx : vx | vy;
+		case IROp::AddIndex:
+		case IROp::FontIndex:
+		case IROp::WriteDelay:
+		case IROp::WriteSound:
+		case IROp::StoreBCD:  return vx;
+		case IROp::StoreRegs: return regRange();
+		case IROp::Draw:      return vx | vy;
+		case IROp::JumpV0:    return 1;
+		case IROp::Skip:      return (Cond)sub == Cond::EqReg || (Cond)sub == Cond::NeReg ? vx | vy : vx;
+		case IROp::WaitKey:   return vx; // only conditionally written, so the old value has to survive
+		case IROp::Invalid:   return 0xffff;
+		default:              return 0;
+		}
+	}
+
+	uint16_t writes() const {
+		const uint16_t vx = 1 << x;
+		const uint16_t flag = writesFlag ? 0x8000 : 0;
+
+		switch (op) {
+		case IROp::LoadImm:
+		case IROp::Copy:
+		case IROp::AddImm:
+		case IROp::Rand:
+		case IROp::ReadDelay:
+		case IROp::WaitKey:   return vx;
+		case IROp::Alu:       return vx | flag;
+		case IROp::LoadRegs:  return regRange();
+		case IROp::Draw:
+		case IROp::DrawConst: return flag;
+		default:              return 0;
+		}
+	}
+};
+
+struct IRBlock {
+	uint16_t startPC = 0;
+	uint16_t endPC = 0;  // pc after the last guest instruction
+	uint16_t skipPC = 0; // where a taken skip goes, past all 4 bytes if the next instruction is F000 nnnn
+	std::vector<uint16_t> instrs; // guest instructions, F000 nnnn counts as one. IRInst::guestIndex indexes into this
+	std::vector<uint16_t> longOperands; // the nnnn of each F000 nnnn in instrs, in order
+	std::vector<IRInst> insts;    // ends with a terminator
+
+	// Guest registers the register allocator keeps in host registers, -1 if in memory
+	std::array<int8_t, 16> hostReg;
+
+	int cycles() const {
+		return (int)instrs.size();
+	}
+};
+
+class IRDecoder {
+public:
+	// Decode a block from startPC, up to the first jump/skip or the end of the page
+	static IRBlock decode(Chip8& core, uint16_t startPC) {
+		IRBlock block;
+		block.startPC = startPC;
+		block.hostReg.fill(-1);
+
+		auto pc = startPC;
+		while (true) {
+			const auto instr = core.read<uint16_t>(pc);
+			const auto guestIndex = (uint8_t)block.instrs.size();
+			block.instrs.push_back(instr);
+			pc += 2;
+
+			const auto startOfInstr = block.insts.size();
+			if (instr == 0xF000) { // the only 4 byte instruction
+				block.longOperands.push_back(core.read<uint16_t>(pc));
+				emit(block, { .op = IROp::SetIndex, .imm = block.longOperands.back() });
+				pc += 2;
+			}
+			else {
+				decodeInstr(block, instr);
+			}
+			for (auto i = startOfInstr; i < block.insts.size(); i++) {
+				block.insts[i].guestIndex = guestIndex;
+			}
+
+			if (block.insts.back().isTerminator()) {
+				break;
+			}
+
+			// Blocks can poke a couple of bytes into the next page, through F000 nnnn or the skip lookahead below.
+			// invalidateRange knows about it
+			if ((pc >> pageShift) != (startPC >> pageShift)) { //If we exceed the page boundary, dip
+				block.insts.push_back({ .op = IROp::FallThrough, .guestIndex = guestIndex });
+				break;
+			}
+		}
+
+		block.endPC = pc;
+		block.skipPC = pc + (core.read<uint16_t>(pc) == 0xF000 ? 4 : 2);
+		return block;
+	}
+
+private:
+	static void emit(IRBlock& block, IRInst inst) {
+		block.insts.push_back(inst);
+	}
+
+	static void decodeInstr(IRBlock& block, uint16_t instr) {
+		const uint8_t x = getx(instr);
+		const uint8_t y = gety(instr);
+		const uint8_t kk = getkk(instr);
+		const uint16_t nnn = getaddr(instr);
+
+		const auto alu = [&](AluOp op, bool flag) {
+			emit(block, { .op = IROp::Alu, .x = x, .y = y, .sub = (uint8_t)op, .writesFlag = flag });
+		};
+		const auto skip = [&](Cond cond) {
+			emit(block, { .op = IROp::Skip, .x = x, .y = y, .sub = (uint8_t)cond, .imm = kk });
+		};
+		const auto invalid = [&]() {
+			emit(block, { .op = IROp::Invalid, .imm = instr });
+		};
+
+		switch (getidentifier(instr)) {
+		case 0x0:
+			switch (nnn) {
+			case 0x0E0: emit(block, { .op = IROp::Clear });                                              break;
+			case 0x0EE: emit(block, { .op = IROp::Return });                                             break;
+			case 0x0FB: emit(block, { .op = IROp::Scroll, .sub = (uint8_t)ScrollDir::Right, .imm = 4 }); break;
+			case 0x0FC: emit(block, { .op = IROp::Scroll, .sub = (uint8_t)ScrollDir::Left, .imm = 4 });  break;
+			case 0x0FE: emit(block, { .op = IROp::SetMode, .imm = 0 });                                  break;
+			case 0x0FF: emit(block, { .op = IROp::SetMode, .imm = 1 });                                  break;
+			default:
+				if ((nnn & 0xff0) == 0x0C0) {
+					emit(block, { .op = IROp::Scroll, .sub = (uint8_t)ScrollDir::Down, .imm = (uint16_t)getn(instr) });
+				} else {
+					invalid();
+				}
+				break;
+			}
+			break;
+		case 0x1: emit(block, { .op = IROp::Jump, .imm = nnn });                     break;
+		case 0x2: emit(block, { .op = IROp::Call, .imm = nnn });                     break;
+		case 0x3: skip(Cond::EqImm);                                                 break;
+		case 0x4: skip(Cond::NeImm);                                                 break;
+		case 0x5:
+			switch (getn(instr)) {
+			case 0x0: skip(Cond::EqReg); break;
+			case 0x2:
+				emit(block, { .op = IROp::StoreRegs, .x = x, .y = y });
+				emit(block, { .op = IROp::Invalidate, .imm = (uint16_t)(std::abs(x - y) + 1) });
+				break;
+			case 0x3: emit(block, { .op = IROp::LoadRegs, .x = x, .y = y }); break;
+			default:  invalid();                                            break;
+			}
+			break;
+		case 0x6: emit(block, { .op = IROp::LoadImm, .x = x, .imm = kk });           break;
+		case 0x7: emit(block, { .op = IROp::AddImm, .x = x, .imm = kk });            break;
+		case 0x8:
+			switch (getn(instr)) {
+			case 0x0: emit(block, { .op = IROp::Copy, .x = x, .y = y }); break;
+			case 0x1: alu(AluOp::Or, false);   break;
+			case 0x2: alu(AluOp::And, false);  break;
+			case 0x3: alu(AluOp::Xor, false);  break;
+			case 0x4: alu(AluOp::Add, true);   break;
+			case 0x5: alu(AluOp::Sub, true);   break;
+			case 0x6: alu(AluOp::Shr, true);   break;
+			case 0x7: alu(AluOp::SubN, true);  break;
+			case 0xE: alu(AluOp::Shl, true);   break;
+			default:  invalid();               break;
+			}
+			break;
+		case 0x9: skip(Cond::NeReg);                                                 break;
+		case 0xA: emit(block, { .op = IROp::SetIndex, .imm = nnn });                 break;
+		case 0xB: emit(block, { .op = IROp::JumpV0, .imm = nnn });                   break;
+		case 0xC: emit(block, { .op = IROp::Rand, .x = x, .imm = kk });              break;
+		case 0xD: emit(block, { .op = IROp::Draw, .x = x, .y = y, .imm = (uint16_t)getn(instr), .writesFlag = true }); break;
+		case 0xE:
+			switch (kk) {
+			case 0x9E: skip(Cond::KeyDown); break;
+			case 0xA1: skip(Cond::KeyUp);   break;
+			default:   invalid();           break;
+			}
+			break;
+		case 0xF:
+			switch (kk) {
+			case 0x01: emit(block, { .op = IROp::SetPlanes, .imm = (uint16_t)(x & 3) });          break;
+			case 0x07: emit(block, { .op = IROp::ReadDelay, .x = x });                              break;
+			case 0x0A: emit(block, { .op = IROp::WaitKey, .x = x });                                break;
+			case 0x15: emit(block, { .op = IROp::WriteDelay, .x = x });                             break;
+			case 0x18: emit(block, { .op = IROp::WriteSound, .x = x });                             break;
+			case 0x1E: emit(block, { .op = IROp::AddIndex, .x = x });                               break;
+			case 0x29: emit(block, { .op = IROp::FontIndex, .x = x });                              break;
+			case 0x33:
+				emit(block, { .op = IROp::StoreBCD, .x = x });
+				emit(block, { .op = IROp::Invalidate, .imm = 3 });
+				break;
+			case 0x55:
+				emit(block, { .op = IROp::StoreRegs, .x = 0, .y = x });
+				emit(block, { .op = IROp::Invalidate, .imm = (uint16_t)(x + 1) });
+				break;
+			case 0x65: emit(block, { .op = IROp::LoadRegs, .x = 0, .y = x }); break;
+			default:   invalid();                                             break;
+			}
+			break;
+		}
+	}
+};
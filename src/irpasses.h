@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <ir.h>
+
+// Optimization passes over an IRBlock, run in order by run()
+class IRPasses {
+public:
+	static constexpr int allocatableRegs = 4; // host registers X64Lowering can keep guest registers in
+
+	static void run(IRBlock& block, bool deadWrites = true) {
+		foldConstants(block);
+		if (deadWrites) {
+			eliminateDeadWrites(block);
+		}
+		allocateRegisters(block);
+	}
+
+	// Forward pass tracking registers with values known at compile time. Ops on known values become LoadImm/SetIndex,
+	// skips on known values become plain jumps, and draws with a known position and sprite address become DrawConst
+	static void foldConstants(IRBlock& block) {
+		std::array<std::optional<uint8_t>, 16> known;
+		std::optional<uint16_t> knownIndex;
+		std::vector<IRInst> folded;
+		folded.reserve(block.insts.size());
+
+		for (auto inst : block.insts) {
+			const auto loadImm = [&](uint8_t reg, uint8_t value) {
+				folded.push_back({ .op = IROp::LoadImm, .x = reg, .imm = value, .guestIndex = inst.guestIndex });
+				known[reg] = value;
+			};
+			const auto vx = known[inst.x];
+			const auto vy = known[inst.y];
+
+			switch (inst.op) {
+			case IROp::LoadImm:
+				loadImm(inst.x, (uint8_t)inst.imm);
+				continue;
+			case IROp::Copy:
+				if (vy) {
+					loadImm(inst.x, *vy);
+					continue;
+				}
+				break;
+			case IROp::AddImm:
+				if (vx) {
+					loadImm(inst.x, (uint8_t)(*vx + inst.imm));
+					continue;
+				}
+				break;
+			case IROp::Alu: {
+				const auto op = (AluOp)inst.sub;
+				const auto unary = op == AluOp::Shr || op == AluOp::Shl;
+				if (vx && (vy || unary)) {
+					const auto [result, flag] = evalAlu(op, *vx, unary ? 0 : *vy);
+					loadImm(inst.x, result);
+					if (inst.writesFlag) {
+						loadImm(0xf, flag);
+					}
+					continue;
+				}
+				break;
+			}
+			case IROp::SetIndex:
+				knownIndex = inst.imm;
+				break;
+			case IROp::AddIndex:
+				if (vx && knownIndex) {
+					inst = { .op = IROp::SetIndex, .imm = (uint16_t)(*knownIndex + *vx), .guestIndex = inst.guestIndex };
+					knownIndex = inst.imm;
+				}
+				else {
+					knownIndex.reset();
+				}
+				break;
+			case IROp::FontIndex:
+				if (vx) {
+					inst = { .op = IROp::SetIndex, .imm = (uint16_t)(*vx * 5), .guestIndex = inst.guestIndex };
+					knownIndex = inst.imm;
+				}
+				else {
+					knownIndex.reset();
+				}
+				break;
+			case IROp::Draw:
+				if (vx && vy && knownIndex) {
+					inst = { .op = IROp::DrawConst, .x = *vx, .y = *vy, .sub = (uint8_t)inst.imm, .imm = *knownIndex,
+						.writesFlag = inst.writesFlag, .guestIndex = inst.guestIndex };
+				}
+				break;
+			case IROp::JumpV0:
+				if (known[0]) {
+					inst = { .op = IROp::Jump, .imm = (uint16_t)(*known[0] + inst.imm), .guestIndex = inst.guestIndex };
+				}
+				break;
+			case IROp::Skip: {
+				std::optional<bool> taken;
+				switch ((Cond)inst.sub) {
+				case Cond::EqImm: if (vx) taken = *vx == inst.imm; break;
+				case Cond::NeImm: if (vx) taken = *vx != inst.imm; break;
+				case Cond::EqReg: if (vx && vy) taken = *vx == *vy; break;
+				case Cond::NeReg: if (vx && vy) taken = *vx != *vy; break;
+				default: break;
+				}
+
+				if (taken) {
+					inst = { .op = IROp::Jump, .imm = *taken ? block.skipPC : block.endPC, .guestIndex = inst.guestIndex };
+				}
+				break;
+			}
+			default:
+				break;
+			}
+
+			// Anything not folded clobbers what it writes
+			const auto writes = inst.writes();
+			for (auto reg = 0; reg < 16; reg++) {
+				if (writes & (1 << reg)) {
+					known[reg].reset();
+				}
+			}
+
+			folded.push_back(inst);
+		}
+
+		block.insts = std::move(folded);
+	}
+
+	// Backward liveness pass. Drops register writes nothing reads before they're overwritten, and flag computations
+	// (VF from ALU ops and sprite collisions) nothing reads. Every register is live at the end of a block
+	static void eliminateDeadWrites(IRBlock& block) {
+		uint16_t live = 0xffff;
+		std::vector<IRInst> kept;
+		kept.reserve(block.insts.size());
+
+		for (auto it = block.insts.rbegin(); it != block.insts.rend(); ++it) {
+			auto inst = *it;
+
+			if (inst.writesFlag && !(live & 0x8000) && !(inst.op == IROp::Alu && inst.x == 0xf)) {
+				inst.writesFlag = false;
+			}
+
+			const auto writes = inst.writes();
+			if (writes && !(writes & live) && isPure(inst.op)) {
+				continue;
+			}
+
+			live = (live & ~writes) | inst.reads();
+			kept.push_back(inst);
+		}
+
+		std::reverse(kept.begin(), kept.end());
+		block.insts = std::move(kept);
+	}
+
+	// Gives the most used guest registers a host register for the whole block. Registers only touched once
+	// aren't worth the load and store around the block
+	static void allocateRegisters(IRBlock& block) {
+		std::array<int, 16> uses = {};
+		for (const auto& inst : block.insts) {
+			if (inst.op == IROp::StoreRegs || inst.op == IROp::LoadRegs || inst.op == IROp::Invalid) { // go through memory
+				continue;
+			}
+
+			const auto touched = inst.reads() | inst.writes();
+			for (auto reg = 0; reg < 16; reg++) {
+				if (touched & (1 << reg)) {
+					++uses[reg];
+				}
+			}
+		}
+
+		std::array<int, 16> order;
+		for (auto reg = 0; reg < 16; reg++) {
+			order[reg] = reg;
+		}
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+			return uses[a] > uses[b];
+		});
+
+		block.hostReg.fill(-1);
+		for (auto i = 0; i < allocatableRegs; i++) {
+			if (uses[order[i]] < 3) {
+				break;
+			}
+			block.hostReg[order[i]] = i;
+		}
+	}
+
+private:
+	struct AluResult {
+		uint8_t result;
+		uint8_t flag;
+	};
+
+	// Has to match what X64Lowering emits for each op
+	static AluResult evalAlu(AluOp op, uint8_t x, uint8_t y) {
+		switch (op) {
+		case AluOp::Or:   return { (uint8_t)(x | y), 0 };
+		case AluOp::And:  return { (uint8_t)(x & y), 0 };
+		case AluOp::Xor:  return { (uint8_t)(x ^ y), 0 };
+		case AluOp::Add:  return { (uint8_t)(x + y), (uint8_t)(x + y > 0xff) };
+		case AluOp::Sub:  return { (uint8_t)(x - y), (uint8_t)(x > y) };
+		case AluOp::SubN: return { (uint8_t)(y - x), (uint8_t)(y > x) };
+		case AluOp::Shr:  return { (uint8_t)(x >> 1), (uint8_t)(x & 1) };
+		case AluOp::Shl:  return { (uint8_t)(x << 1), (uint8_t)(x >> 7) };
+		}
+		return { 0, 0 };
+	}
+
+	// Ops that only write registers, so they can go if their result is dead.
+	// Rand isn't, dropping one would change the sequence every later Cxkk sees
+	static bool isPure(IROp op) {
+		switch (op) {
+		case IROp::LoadImm:
+		case IROp::Copy:
+		case IROp::AddImm:
+		case IROp::Alu:
+		case IROp::ReadDelay:
+			return true;
+		default:
+			return false;
+		}
+	}
+};
@@ -1,18 +1,134 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <unordered_map>
+#include <vector>
 #include <xbyak/xbyak.h>
+#include <xbyak/xbyak_util.h>
+#include <chip8.h>
+#include <codememory.h>
+#include <perfmap.h>
+#include <stats.h>
 
 using namespace Xbyak::util;
 using fp = int(*)();
 using interpreterfp = void(*)(Chip8&, uint16_t);
 
+// Argument registers for calls between C++ and emitted code
+#ifdef _WIN32
+const Xbyak::Reg64 abiParam1(Xbyak::Operand::RCX);
+const Xbyak::Reg64 abiParam2(Xbyak::Operand::RDX);
+const Xbyak::Reg64 abiParam3(Xbyak::Operand::R8);
+#else
+const Xbyak::Reg64 abiParam1(Xbyak::Operand::RDI);
+const Xbyak::Reg64 abiParam2(Xbyak::Operand::RSI);
+const Xbyak::Reg64 abiParam3(Xbyak::Operand::RDX);
+#endif
+
+// What the host can run, probed once. SSE2 comes with x64, AVX-512 needs BW for byte shuffles and VL for the
+// ymm/xmm forms the AVX2 paths keep using alongside it
+struct HostCpu {
+	SimdLevel simd = SimdLevel::SSE2;
+
+	static const HostCpu& get() {
+		static const HostCpu host = [] {
+			using Cpu = Xbyak::util::Cpu;
+			Cpu cpu;
+			HostCpu host;
+			if (cpu.has(Cpu::tAVX512F) && cpu.has(Cpu::tAVX512BW) && cpu.has(Cpu::tAVX512VL)) {
+				host.simd = SimdLevel::AVX512;
+			}
+			else if (cpu.has(Cpu::tAVX2)) {
+				host.simd = SimdLevel::AVX2;
+			}
+			return host;
+		}();
+		return host;
+	}
+
+	// The host's best, but no more than cap (Config::maxSimd)
+	static SimdLevel level(SimdLevel cap) {
+		return std::min(get().simd, cap);
+	}
+};
+
 //The entire code emitter. God bless xbyak
-constexpr int cacheSize = 64 * 1024 * 1024;
-constexpr int cacheLeeway = 1024; // If currentCacheSize + cacheLeeway > cacheSize, reset cache
-uint8_t cache[cacheSize]; // emitted code cache //TODO: figure out rip relative addressing
-class x64Emitter : public Xbyak::CodeGenerator {
+constexpr size_t cacheChunk = 64 * 1024;          // code caches start at and grow by multiples of this
+constexpr size_t maxCacheSize = 64 * 1024 * 1024; // address space reserved per code cache
+constexpr size_t hostBytesPerInstr = 32; // rough guess for sizing caches up front
+// Code is written through getCurr() and friends, which point into the RW view of the cache. Anything that gets run
+// or jumped to at runtime (block pointers, the trampoline, stub addresses) has to go through rx() first.
+// Jumps between two places in the cache are relative, so they can be emitted with RW addresses on both ends
+class x64Emitter : public CodeMemory, public Xbyak::CodeGenerator {
 public:
-	x64Emitter() : CodeGenerator(cacheSize) { // Initialize emitter and memory
-		setProtectMode(PROTECT_RWE); // Mark emitter memory as readadable/writeable/executable
+	x64Emitter(size_t capacity = cacheChunk) : CodeMemory(maxCacheSize),
+		CodeGenerator(roundUpCapacity(capacity), nullptr, this) {} // memory comes from CodeMemory
+
+	size_t capacity() const {
+		return maxSize_;
+	}
+
+	// Commit another chunk in place, false once maxCacheSize is reached and the cache has to be thrown out instead
+	bool grow() {
+		if (maxSize_ + cacheChunk > maxCacheSize || !commit(maxSize_ + cacheChunk)) {
+			return false;
+		}
+		maxSize_ += cacheChunk;
+		return true;
+	}
+
+	// Make room for bytes more code, growing as much as it takes. False if the cache can't get that big, then it
+	// has to be thrown out. Backends ask for their worst case block before compiling one
+	bool makeRoom(size_t bytes) {
+		while (getSize() + bytes > capacity()) {
+			if (!grow()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	static size_t roundUpCapacity(size_t capacity) {
+		capacity = (capacity + cacheChunk - 1) / cacheChunk * cacheChunk;
+		return std::clamp(capacity, cacheChunk, maxCacheSize);
+	}
+};
+
+// Where a block's guest code ended up in the code cache, kept for annotated dumps
+struct BlockInfo {
+	uint16_t startPC;
+	uint16_t endPC; // exclusive
+	size_t hostOffset; // from the start of the code cache
+	size_t hostSize;
+	std::vector<uint16_t> instrs;
+	std::vector<uint16_t> longOperands; // the nnnn of each F000 nnnn in instrs, in order
+	std::vector<size_t> guestOffsets; // host offset (from hostOffset) each guest instruction's code starts at
+	size_t epilogueOffset;            // host offset (from hostOffset) the epilogue starts at
+
+	BlockInfo(const Xbyak::CodeGenerator& code, uint16_t startPC) : startPC(startPC), endPC(startPC),
+		hostOffset(code.getSize()), hostSize(0), epilogueOffset(0) {}
+
+	// Call before emitting each guest instruction
+	void beginInstr(const Xbyak::CodeGenerator& code, uint16_t instr) {
+		instrs.push_back(instr);
+		guestOffsets.push_back(code.getSize() - hostOffset);
+		endPC += 2;
+	}
+
+	// Call after beginInstr for F000, with the word after it
+	void addLongOperand(uint16_t operand) {
+		longOperands.push_back(operand);
+		endPC += 2;
+	}
+
+	void beginEpilogue(const Xbyak::CodeGenerator& code) {
+		epilogueOffset = code.getSize() - hostOffset;
+	}
+
+	void end(const Xbyak::CodeGenerator& code) {
+		hostSize = code.getSize() - hostOffset;
 	}
 };
 
@@ -20,3 +136,69 @@ constexpr int pageSize = 32; // size of cache pages
 constexpr int pageShift = 5; // shift required to get page froma given address
 //TODO: ctz
 
+// Predicts 00EE. Compiled 2nnn pushes its return pc along with a landing stub in its block, which is a linked
+// exit into the block at the return pc. Compiled 00EE jumps to the top landing stub if the pcs match.
+// It's a ring, so deep recursion just loses the oldest predictions
+struct ReturnStack {
+	static constexpr int size = 16;
+	static constexpr uint32_t invalidPC = 0xffffffff;
+
+	struct Entry {
+		uint32_t guestPC = invalidPC;
+		uint32_t pad = 0;
+		const uint8_t* host = nullptr;
+	};
+	static_assert(sizeof(Entry) == 16, "emitted code indexes entries with a shift");
+
+	std::array<Entry, size> entries;
+	uint32_t top = 0;
+
+	void clear() {
+		entries.fill({});
+		top = 0;
+	}
+};
+
+// Inline cache for a Bnnn site. Each entry is a cmp against an imm32 pc and a jmp to that pc's block, both patched
+// in place when a miss fills the entry. Entry jmps are link sites, so they get unlinked with everything else
+struct TargetCache {
+	static constexpr int size = 4;
+	static constexpr uint16_t invalidPC = 0xffff;
+
+	struct Entry {
+		uint16_t pc = invalidPC;
+		uint8_t* compare = nullptr; // imm32 of the cmp
+		uint8_t* jump = nullptr;    // rel32 of the jmp
+	};
+
+	std::array<Entry, size> entries;
+	int next = 0; // filled round robin
+};
+
+// Code cache and block lookup for a backend built on the IR (see x64lowering.h).
+// Its blocks aren't functions: they expect rbp = &core and a frame with shadow space, so they're entered through
+// a trampoline emitted at the start of the cache. They chain into each other until the cycle budget
+// they're entered with runs out, then jump to the trampoline's exit
+struct JitContext {
+	using enterfp = int(*)(fp block, Chip8* core, int cycleBudget);
+
+	const char* name;
+	x64Emitter code;
+	// Host code for every pc in all 64KB, indexed by pc >> 1. Uncompiled pcs point at compileStub, so lookups never
+	// branch. Odd pcs are rare enough to get their own table instead of doubling the hot one
+	std::array<fp, RAM_SIZE / 2> blockTable = {};
+	std::array<fp, RAM_SIZE / 2> oddBlockTable = {};
+	// Non zero for pages (pageSize bytes of ram) a compiled block starts on, so stores only call out to invalidate
+	// when they might hit code
+	std::array<uint8_t, RAM_SIZE / pageSize> codePages = {};
+	fp compileStub = nullptr;
+	std::vector<BlockInfo> blockInfo; // for annotated code cache dumps
+	// Exit jmps into each pc. Only pcs something jumps to have any, so it's a map rather than 64K empty vectors
+	std::unordered_map<uint16_t, std::vector<uint8_t*>> linkSites;
+	ReturnStack returnStack;
+	std::deque<TargetCache> targetCaches; // deque so emitted code can hold pointers to them
+	enterfp enter = nullptr;          // null until the trampoline is emitted
+	const uint8_t* exit = nullptr;
+
+	JitContext(const char* name, size_t capacity) : name(name), code(capacity) {}
+};
@@ -1,8 +1,40 @@
 #include <gui.h>
+#include <config.h>
+#include <disassembler.h>
+#include <replay.h>
+#include <conformance.h>
+#include <fuzzer.h>
+#include <benchmark.h>
 
-int main()
+#ifdef JIT8_LIBFUZZER
+// Built with -DJIT8_LIBFUZZER=ON, libFuzzer brings its own main and calls this with every input
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	Fuzzer::runInput(data, size);
+	return 0;
+}
+#else
+
+int main(int argc, char** argv)
 {
-	auto gui = GUI();
+	const auto config = Config::fromArgs(argc, argv);
+	if (config.replayPath) { // headless, no window
+		return Replay::run(config);
+	}
+	if (config.conformancePath) {
+		return Conformance::run(config);
+	}
+	if (config.checkDisassembler) {
+		return Chip8Disassembler::check();
+	}
+	if (config.fuzzPrograms > 0) {
+		return Fuzzer::run(config);
+	}
+	if (config.benchFilter) {
+		return Benchmark::run(config);
+	}
+
+	auto gui = GUI(config);
 	gui.run();
 	return 0;
 }
+#endif
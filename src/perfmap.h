@@ -0,0 +1,143 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Tells linux perf about recompiled blocks, so samples inside the code cache get a name instead of an address.
+// The perf map (/tmp/perf-<pid>.map) is enough for perf report. The jitdump (jit-<pid>.dump) also carries the
+// code bytes, so after `perf record -k mono` and `perf inject --jit`, perf annotate can show the emitted code.
+// Everything here is a no-op on other platforms
+class PerfMap {
+public:
+	static void enable(bool perfMap, bool jitdump) {
+#ifdef __linux__
+		char path[64];
+
+		if (perfMap && !mapFile) {
+			snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+			mapFile = fopen(path, "w");
+			if (!mapFile) {
+				printf("Couldn't open %s\n", path);
+			}
+		}
+
+		if (jitdump && !dumpFile) {
+			snprintf(path, sizeof(path), "jit-%d.dump", getpid());
+			dumpFile = fopen(path, "w+");
+			if (!dumpFile) {
+				printf("Couldn't open %s\n", path);
+				return;
+			}
+
+			// perf finds the jitdump through an executable mapping of it showing up in the trace
+			dumpMarker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(dumpFile), 0);
+			if (dumpMarker == MAP_FAILED) {
+				dumpMarker = nullptr;
+				printf("Couldn't mmap the jitdump, perf won't find it\n");
+			}
+
+			JitHeader header;
+			header.timestamp = timestamp();
+			header.pid = getpid();
+			fwrite(&header, sizeof(header), 1, dumpFile);
+			fflush(dumpFile);
+		}
+#endif
+	}
+
+	static bool enabled() {
+		return mapFile || dumpFile;
+	}
+
+	// Register a freshly compiled block, named after the guest pc it starts at
+	static void registerBlock(const void* code, size_t size, uint16_t pc, const char* backend) {
+		if (!enabled()) [[likely]] {
+			return;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "chip8_blk_0x%03x [%s]", pc, backend);
+		registerCode(code, size, name);
+	}
+
+	// Register any other emitted code, like dispatch trampolines
+	static void registerCode(const void* code, size_t size, const char* name) {
+#ifdef __linux__
+		if (!enabled()) [[likely]] {
+			return;
+		}
+
+		if (mapFile) {
+			fprintf(mapFile, "%lx %zx %s\n", (unsigned long)(uintptr_t)code, size, name);
+			fflush(mapFile); // perf reads the map after we're gone, don't lose it to a crash
+		}
+
+		if (dumpFile) {
+			const auto nameSize = strlen(name) + 1;
+
+			JitCodeLoad record;
+			record.totalSize = (uint32_t)(sizeof(record) + nameSize + size);
+			record.timestamp = timestamp();
+			record.pid = getpid();
+			record.tid = (uint32_t)syscall(SYS_gettid);
+			record.vma = (uintptr_t)code;
+			record.codeAddr = (uintptr_t)code;
+			record.codeSize = size;
+			record.codeIndex = codeIndex++;
+
+			fwrite(&record, sizeof(record), 1, dumpFile);
+			fwrite(name, nameSize, 1, dumpFile);
+			fwrite(code, size, 1, dumpFile);
+			fflush(dumpFile);
+		}
+#endif
+	}
+
+private:
+	inline static FILE* mapFile = nullptr;
+	inline static FILE* dumpFile = nullptr;
+	inline static void* dumpMarker = nullptr;
+	inline static uint64_t codeIndex = 0;
+
+	// Layouts from tools/perf/Documentation/jitdump-specification.txt
+	struct JitHeader {
+		uint32_t magic = 0x4A695444;
+		uint32_t version = 1;
+		uint32_t totalSize = sizeof(JitHeader);
+		uint32_t elfMach = 62; // EM_X86_64
+		uint32_t pad1 = 0;
+		uint32_t pid = 0;
+		uint64_t timestamp = 0;
+		uint64_t flags = 0;
+	};
+
+	struct JitCodeLoad {
+		uint32_t id = 0; // JIT_CODE_LOAD
+		uint32_t totalSize = 0;
+		uint64_t timestamp = 0;
+		uint32_t pid = 0;
+		uint32_t tid = 0;
+		uint64_t vma = 0;
+		uint64_t codeAddr = 0;
+		uint64_t codeSize = 0;
+		uint64_t codeIndex = 0;
+	};
+
+	// Has to match the clock perf records with (-k mono)
+	static uint64_t timestamp() {
+#ifdef __linux__
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+		return 0;
+#endif
+	}
+};
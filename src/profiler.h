@@ -0,0 +1,163 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <disassembler.h>
+
+// Counters for one compiled block. Recompiled code bumps these directly, so they need stable addresses
+struct BlockProfile {
+	uint64_t executions = 0; // incremented on every block entry
+	uint64_t cycles = 0;     // guest instructions retired, only if cycle accounting is enabled
+	uint16_t startPC = 0;
+	uint16_t endPC = 0;      // exclusive
+	const char* backend = "";
+	std::vector<uint16_t> instrs; // guest code as it was when the block was compiled
+	std::vector<uint16_t> longOperands; // the nnnn of each F000 nnnn in instrs, in order
+};
+
+// Opt-in per block execution counters, and a report of where guest time goes.
+// When disabled the recompilers emit nothing, so it costs nothing.
+class BlockProfiler {
+public:
+	bool enabled = false;     // emit a per block execution counter
+	bool countCycles = false; // also emit retired cycle accounting
+
+	// Register a block that's about to be compiled, returns where its counters live
+	BlockProfile* addBlock(uint16_t startPC, const char* backend) {
+		auto& profile = blocks.emplace_back();
+		profile.startPC = startPC;
+		profile.backend = backend;
+		return &profile;
+	}
+
+	void dumpReport(const char* path) {
+		FILE* file = fopen(path, "w");
+		if (!file) {
+			printf("Couldn't open %s for the hotspot report\n", path);
+			return;
+		}
+
+		// Merge blocks that were compiled more than once (invalidated, cache flushed or in another backend)
+		struct Hotspot {
+			const BlockProfile* block; // most recent compile
+			uint64_t executions = 0;
+			uint64_t cycles = 0;
+		};
+
+		std::map<std::pair<uint16_t, uint16_t>, Hotspot> merged;
+		uint64_t totalExecutions = 0;
+		uint64_t totalCycles = 0;
+
+		for (const auto& block : blocks) {
+			if (!block.executions) {
+				continue;
+			}
+
+			auto& hotspot = merged[{ block.startPC, block.endPC }];
+			hotspot.block = &block;
+			hotspot.executions += block.executions;
+			// Blocks always run to completion, so without cycle accounting cycles can be estimated
+			hotspot.cycles += countCycles ? block.cycles : block.executions * block.instrs.size();
+			totalExecutions += block.executions;
+		}
+
+		std::vector<Hotspot> hotspots;
+		for (auto& [range, hotspot] : merged) {
+			totalCycles += hotspot.cycles;
+			hotspots.push_back(hotspot);
+		}
+
+		std::sort(hotspots.begin(), hotspots.end(), [](const Hotspot& a, const Hotspot& b) {
+			return a.cycles > b.cycles;
+		});
+
+		fprintf(file, "JIT8 hotspot report\n");
+		fprintf(file, "%zu blocks executed, %llu block executions, %llu guest cycles%s\n\n",
+			hotspots.size(), (unsigned long long)totalExecutions, (unsigned long long)totalCycles,
+			countCycles ? "" : " (estimated from block lengths)");
+
+		// Blocks that together cover 90% of guest cycles are worth heavier optimization
+		fprintf(file, "rank  range          backend   executions       cycles  %%cycles   cumul  instrs\n");
+		double cumulative = 0;
+		for (auto i = 0; i < hotspots.size(); i++) {
+			const auto& hotspot = hotspots[i];
+			const auto share = totalCycles ? 100.0 * hotspot.cycles / totalCycles : 0.0;
+			const auto hot = cumulative < 90.0;
+			cumulative += share;
+
+			fprintf(file, "%4d  0x%03X-0x%03X  %-8s %11llu %12llu  %6.2f  %6.2f  %6zu%s\n",
+				i + 1, hotspot.block->startPC, hotspot.block->endPC - 2, hotspot.block->backend,
+				(unsigned long long)hotspot.executions, (unsigned long long)hotspot.cycles,
+				share, cumulative, hotspot.block->instrs.size(), hot ? "  HOT" : "");
+		}
+
+		// Disassembly and opcode mix of the hot blocks
+		fprintf(file, "\nHot block disassembly\n");
+		for (const auto& hotspot : hotspots) {
+			if (hotspot.cycles * 100 < totalCycles * 1) { // anything under 1% isn't interesting
+				break;
+			}
+
+			fprintf(file, "\nblock 0x%03X-0x%03X, %llu executions\n", hotspot.block->startPC,
+				hotspot.block->endPC - 2, (unsigned long long)hotspot.executions);
+			auto pc = hotspot.block->startPC;
+			auto operand = hotspot.block->longOperands.begin();
+			for (const auto instr : hotspot.block->instrs) {
+				if (instr == 0xF000) {
+					fprintf(file, "  0x%03X: F000 %04X  LD I, long 0x%04X\n", pc, *operand, *operand);
+					++operand;
+					pc += 4;
+				} else {
+					fprintf(file, "  0x%03X: %04X       %s\n", pc, instr, Chip8Disassembler::disassemble(instr).c_str());
+					pc += 2;
+				}
+			}
+		}
+
+		// Call/return edges. The return of a call at pc always lands on pc + 2
+		fprintf(file, "\nCall edges\n");
+		for (const auto& hotspot : hotspots) {
+			const auto last = hotspot.block->instrs.back();
+			if (getidentifier(last) == 0x2) {
+				fprintf(file, "  0x%03X -> CALL 0x%03X, returns to 0x%03X  x%llu\n", hotspot.block->endPC - 2,
+					getaddr(last), hotspot.block->endPC, (unsigned long long)hotspot.executions);
+			}
+		}
+
+		fprintf(file, "\nReturn sites\n");
+		for (const auto& hotspot : hotspots) {
+			if (hotspot.block->instrs.back() == 0x00EE) {
+				fprintf(file, "  0x%03X RET  x%llu\n", hotspot.block->endPC - 2, (unsigned long long)hotspot.executions);
+			}
+		}
+
+		// Opcode mix, weighted by how often each block ran
+		std::map<std::string, uint64_t> opcodeMix;
+		for (const auto& hotspot : hotspots) {
+			for (const auto instr : hotspot.block->instrs) {
+				opcodeMix[Chip8Disassembler::opcodeClass(instr)] += hotspot.executions;
+			}
+		}
+
+		std::vector<std::pair<std::string, uint64_t>> sortedMix(opcodeMix.begin(), opcodeMix.end());
+		std::sort(sortedMix.begin(), sortedMix.end(), [](const auto& a, const auto& b) {
+			return a.second > b.second;
+		});
+
+		fprintf(file, "\nOpcode mix\n");
+		for (const auto& [opcode, count] : sortedMix) {
+			fprintf(file, "  %-14s %12llu  %6.2f%%\n", opcode.c_str(), (unsigned long long)count,
+				totalCycles ? 100.0 * count / totalCycles : 0.0);
+		}
+
+		fclose(file);
+		printf("Wrote hotspot report to %s\n", path);
+	}
+
+private:
+	std::deque<BlockProfile> blocks; // deque so pointers handed to recompiled code stay valid
+};
@@ -0,0 +1,162 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chip8.h>
+#include <config.h>
+
+// Everything it takes to play a run back exactly: the rng seed, the speed, and the keypad state of every frame.
+// Saved as "JIT8KEYS", seed, speed and frame count as 32 bit words, then a 16 bit keypad word per frame
+struct InputLog {
+	static constexpr char magic[8] = { 'J', 'I', 'T', '8', 'K', 'E', 'Y', 'S' };
+
+	uint32_t seed = 0;
+	uint32_t speed = 0;
+	std::vector<uint16_t> frames;
+
+	bool save(const char* path) const {
+		FILE* file = fopen(path, "wb");
+		if (!file) {
+			printf("Couldn't open %s\n", path);
+			return false;
+		}
+
+		const uint32_t count = (uint32_t)frames.size();
+		fwrite(magic, 1, sizeof(magic), file);
+		fwrite(&seed, sizeof(seed), 1, file);
+		fwrite(&speed, sizeof(speed), 1, file);
+		fwrite(&count, sizeof(count), 1, file);
+		fwrite(frames.data(), sizeof(uint16_t), frames.size(), file);
+		fclose(file);
+		return true;
+	}
+
+	bool load(const char* path) {
+		FILE* file = fopen(path, "rb");
+		if (!file) {
+			return false;
+		}
+
+		char header[sizeof(magic)] = {};
+		uint32_t count = 0;
+		auto ok = fread(header, 1, sizeof(header), file) == sizeof(header) && !memcmp(header, magic, sizeof(magic)) &&
+			fread(&seed, sizeof(seed), 1, file) == 1 && fread(&speed, sizeof(speed), 1, file) == 1 &&
+			fread(&count, sizeof(count), 1, file) == 1;
+		if (ok) {
+			frames.resize(count);
+			ok = fread(frames.data(), sizeof(uint16_t), count, file) == count;
+		}
+
+		fclose(file);
+		return ok;
+	}
+};
+
+// Plays an input log back headless (--replay), to check performance work didn't change what roms do.
+// Every recompiling backend runs in lockstep with the interpreter, and the first frame their displays differ on
+// is reported. Blocks can run past the end of a frame, so the interpreter runs exactly as many cycles as the
+// backend did each frame. That way timers tick on the same instruction on both, and the displays have to match
+// bit for bit
+class Replay {
+public:
+	using clock = std::chrono::steady_clock;
+
+	// Process exit code, non zero if any backend diverged
+	static int run(const Config& config) {
+		InputLog log;
+		if (!log.load(config.replayPath)) {
+			printf("Couldn't read input log %s\n", config.replayPath);
+			return 1;
+		}
+
+		auto headless = config;
+		headless.seed = log.seed;
+		headless.speed = (int)log.speed;
+		headless.recordPath = nullptr;
+		headless.dumpCode = false;
+		printf("Replaying %zu frames of %s, seed 0x%08X, %u cycles a second\n", log.frames.size(), config.romPath,
+			log.seed, log.speed);
+
+		if (config.hashesPath && !writeHashes(headless, log, config.hashesPath)) {
+			return 1;
+		}
+
+		auto diverged = false;
+		for (auto backend : { Backend::CachedInterpreter, Backend::Dynarec, Backend::AOT }) {
+			diverged |= !compare(headless, log, backend);
+		}
+		return diverged ? 1 : 0;
+	}
+
+	// FNV-1a over the words of every plane, and the mode so switching to an empty screen counts
+	static uint64_t displayHash(const Chip8& core) {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		const auto mix = [&](uint64_t value) {
+			hash = (hash ^ value) * 0x100000001b3ull;
+		};
+
+		for (const auto word : core.display) {
+			mix(word);
+		}
+		mix(core.hires);
+		return hash;
+	}
+
+private:
+	static std::unique_ptr<Chip8> makeCore(Config config, Backend backend) {
+		config.backend = backend;
+		return std::make_unique<Chip8>(nullptr, config);
+	}
+
+	// The interpreter's hash after every frame, a line each
+	static bool writeHashes(const Config& config, const InputLog& log, const char* path) {
+		FILE* file = fopen(path, "w");
+		if (!file) {
+			printf("Couldn't open %s\n", path);
+			return false;
+		}
+
+		auto core = makeCore(config, Backend::Interpreter);
+		auto dispatches = 0;
+		for (const auto keys : log.frames) {
+			core->keyState.store(keys, std::memory_order_relaxed);
+			core->emulateFrame(config.speed / 60, false, dispatches);
+			fprintf(file, "%016llx\n", (unsigned long long)displayHash(*core));
+		}
+
+		fclose(file);
+		return true;
+	}
+
+	static bool compare(const Config& config, const InputLog& log, Backend backend) {
+		auto reference = makeCore(config, Backend::Interpreter);
+		auto core = makeCore(config, backend);
+
+		auto dispatches = 0;
+		auto referenceDispatches = 0;
+		clock::duration elapsed = {};
+
+		for (size_t frame = 0; frame < log.frames.size(); frame++) {
+			core->keyState.store(log.frames[frame], std::memory_order_relaxed);
+			reference->keyState.store(log.frames[frame], std::memory_order_relaxed);
+
+			const auto start = clock::now();
+			const auto cycles = core->emulateFrame(config.speed / 60, false, dispatches);
+			elapsed += clock::now() - start;
+			reference->emulateFrame(cycles, false, referenceDispatches);
+
+			if (displayHash(*core) != displayHash(*reference)) {
+				printf("%-17s diverged on frame %zu | pc 0x%04X, interpreter at 0x%04X\n", backendName(backend), frame,
+					core->pc, reference->pc);
+				return false;
+			}
+		}
+
+		printf("%-17s matches the interpreter on all %zu frames | %.3f ms, %d dispatches\n", backendName(backend),
+			log.frames.size(), std::chrono::duration<double, std::milli>(elapsed).count(), dispatches);
+		return true;
+	}
+};
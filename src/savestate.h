@@ -0,0 +1,165 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <chip8.h>
+
+// Everything a running rom can see, so loading one puts the guest back exactly where it was.
+// Plain bytes with no padding, so states can be copied, compared and diffed with memcpy and friends
+struct SaveState {
+	std::array<uint8_t, RAM_SIZE> ram;
+	std::array<uint16_t, 16> stack;
+	std::array<uint8_t, 16> gpr;
+	std::array<uint64_t, PLANE_WORDS * DISPLAY_PLANES> display;
+	uint16_t pc = 0;
+	uint16_t index = 0;
+	uint32_t rng = 0;
+	uint8_t sp = 0;
+	uint8_t delay = 0;
+	uint8_t sound = 0;
+	uint8_t hires = 0;
+	uint8_t planes = 0;
+	std::array<uint8_t, 3> reserved = {}; // rounds the struct up to its alignment, so there are no padding bytes to diff
+};
+static_assert(std::is_trivially_copyable_v<SaveState> && std::has_unique_object_representations_v<SaveState>,
+	"save states are handled as raw bytes");
+
+// Save state hotkeys are pressed on the GUI thread, but states can only be touched between frames on the emu thread
+enum class StateRequest : uint8_t {
+	None,
+	Save,
+	Load,
+};
+
+// Rewind history, a snapshot per frame. Only the newest state is kept whole, every older one is stored as the XOR
+// of itself and the state after it, run length encoded. A frame usually touches a few registers and display rows,
+// so the XORs are nearly all zeroes and a minute of history comes to a few hundred KB.
+// Stepping back XORs the newest delta into the newest state and drops it
+class RewindBuffer {
+public:
+	explicit RewindBuffer(size_t capacity) : capacity(capacity), latest(std::make_unique<SaveState>()) {}
+
+	void push(const SaveState& state) {
+		if (hasLatest) {
+			deltas.push_back(encode(*latest, state));
+			bytes += deltas.back().size();
+			if (deltas.size() > capacity) {
+				bytes -= deltas.front().size();
+				deltas.pop_front();
+			}
+		}
+
+		*latest = state;
+		hasLatest = true;
+	}
+
+	// Step back a frame into state, false once we're out of history
+	bool stepBack(SaveState& state) {
+		if (deltas.empty()) {
+			return false;
+		}
+
+		apply(deltas.back(), *latest);
+		bytes -= deltas.back().size();
+		deltas.pop_back();
+		state = *latest;
+		return true;
+	}
+
+	size_t frames() const {
+		return deltas.size();
+	}
+
+	size_t sizeBytes() const {
+		return bytes;
+	}
+
+private:
+	static constexpr size_t stateSize = sizeof(SaveState);
+	static constexpr int minGap = 4; // equal bytes it takes to end a literal run, shorter gaps are cheaper to XOR through
+
+	const size_t capacity; // in frames
+	std::unique_ptr<SaveState> latest;
+	bool hasLatest = false;
+	std::deque<std::vector<uint8_t>> deltas;
+	size_t bytes = 0;
+
+	// Runs of (bytes to skip, byte count, XORed bytes), counts as LEB128 varints
+	static std::vector<uint8_t> encode(const SaveState& older, const SaveState& newer) {
+		const auto a = (const uint8_t*)&older;
+		const auto b = (const uint8_t*)&newer;
+		std::vector<uint8_t> out;
+
+		size_t pos = 0;
+		size_t runEnd = 0; // end of the last literal run
+		while (true) {
+			// Skip what didn't change, a word at a time while we can
+			while (pos + 8 <= stateSize && !memcmp(a + pos, b + pos, 8)) {
+				pos += 8;
+			}
+			while (pos < stateSize && a[pos] == b[pos]) {
+				pos++;
+			}
+			if (pos == stateSize) {
+				break;
+			}
+
+			auto end = pos;
+			auto same = 0;
+			while (end < stateSize && same < minGap) {
+				same = a[end] == b[end] ? same + 1 : 0;
+				end++;
+			}
+			end -= same;
+
+			putVarint(out, pos - runEnd);
+			putVarint(out, end - pos);
+			for (auto i = pos; i < end; i++) {
+				out.push_back(a[i] ^ b[i]);
+			}
+			pos = runEnd = end;
+		}
+
+		out.shrink_to_fit();
+		return out;
+	}
+
+	static void apply(const std::vector<uint8_t>& delta, SaveState& state) {
+		const auto p = (uint8_t*)&state;
+		size_t in = 0;
+		size_t pos = 0;
+
+		while (in < delta.size()) {
+			pos += getVarint(delta, in);
+			const auto length = getVarint(delta, in);
+			for (size_t i = 0; i < length; i++) {
+				p[pos++] ^= delta[in++];
+			}
+		}
+	}
+
+	static void putVarint(std::vector<uint8_t>& out, size_t value) {
+		while (value >= 0x80) {
+			out.push_back((uint8_t)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((uint8_t)value);
+	}
+
+	static size_t getVarint(const std::vector<uint8_t>& in, size_t& pos) {
+		size_t value = 0;
+		for (auto shift = 0; ; shift += 7) {
+			const auto byte = in[pos++];
+			value |= (size_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				return value;
+			}
+		}
+	}
+};
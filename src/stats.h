@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+
+// Runtime counters for a core. Only the emu thread writes them, so updates are plain load + store
+// instead of locked rmw's, and any other thread can read them without locking
+struct JitStats {
+	using counter = std::atomic<uint64_t>;
+	static_assert(sizeof(counter) == sizeof(uint64_t) && counter::is_always_lock_free,
+		"recompiled code bumps counters as plain qwords");
+
+	counter instructionsRetired = 0;
+	counter blocksDispatched = 0;
+	counter dispatcherMisses = 0; // dispatches that had to compile a block first
+	counter blocksCompiled = 0;
+	counter compileTimeNs = 0;    // time spent in recompileBlock
+	counter codeBytesUsed = 0;    // current code cache usage
+	counter codeBytesFlushed = 0; // thrown away by code cache resets
+	counter invalidations = 0;    // Fx33/Fx55/5xy2 stores that invalidated code (in the recompilers, only ones that hit code)
+	counter stateInvalidations = 0; // pages of code thrown out by state loads, which rewind and run-ahead do every frame
+	counter frames = 0;
+	counter cyclesLastFrame = 0;
+
+	static void bump(counter& c, uint64_t n = 1) {
+		c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	static void set(counter& c, uint64_t n) {
+		c.store(n, std::memory_order_relaxed);
+	}
+
+	static uint64_t get(const counter& c) {
+		return c.load(std::memory_order_relaxed);
+	}
+};
+
+// Times a block compile and adds it to the stats
+class CompileTimer {
+public:
+	CompileTimer(JitStats& stats) : stats(stats), start(std::chrono::steady_clock::now()) {}
+
+	~CompileTimer() {
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		JitStats::bump(stats.compileTimeNs, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	}
+
+private:
+	JitStats& stats;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Prints a line of stats every interval, as rates over the interval plus running totals
+class StatsReporter {
+public:
+	StatsReporter(const JitStats& stats, double interval, const char* path) : stats(stats), interval(interval) {
+		file = stdout;
+		if (path) {
+			file = fopen(path, "w");
+			if (!file) {
+				printf("Couldn't open %s for stats, using stdout\n", path);
+				file = stdout;
+			}
+		}
+
+		lastReport = std::chrono::steady_clock::now();
+		snapshot(last);
+	}
+
+	~StatsReporter() {
+		if (file != stdout) {
+			fclose(file);
+		}
+	}
+
+	// Call once per frame, reports if the interval has passed
+	void update() {
+		const auto now = std::chrono::steady_clock::now();
+		const auto elapsed = std::chrono::duration<double>(now - lastReport).count();
+		if (elapsed < interval) [[likely]] {
+			return;
+		}
+
+		Snapshot current;
+		snapshot(current);
+
+		const auto frames = current.frames - last.frames;
+		fprintf(file, "stats | %.0f instrs/s, %.0f blocks/s, %.2f instrs/block, %.1f cycles/frame | "
+			"%llu misses, %llu compiled, %.3f ms compiling | cache %.1f KB used, %.1f KB flushed | %llu invalidations, %llu pages by state loads\n",
+			(current.instructions - last.instructions) / elapsed,
+			(current.dispatched - last.dispatched) / elapsed,
+			current.dispatched != last.dispatched ? (double)(current.instructions - last.instructions) / (current.dispatched - last.dispatched) : 0.0,
+			frames ? (double)(current.instructions - last.instructions) / frames : 0.0,
+			(unsigned long long)(current.misses - last.misses),
+			(unsigned long long)(current.compiled - last.compiled),
+			(current.compileTimeNs - last.compileTimeNs) / 1e6,
+			JitStats::get(stats.codeBytesUsed) / 1024.0,
+			JitStats::get(stats.codeBytesFlushed) / 1024.0,
+			(unsigned long long)(current.invalidations - last.invalidations),
+			(unsigned long long)(current.stateInvalidations - last.stateInvalidations));
+		fflush(file);
+
+		last = current;
+		lastReport = now;
+	}
+
+private:
+	struct Snapshot {
+		uint64_t instructions;
+		uint64_t dispatched;
+		uint64_t misses;
+		uint64_t compiled;
+		uint64_t compileTimeNs;
+		uint64_t invalidations;
+		uint64_t stateInvalidations;
+		uint64_t frames;
+	};
+
+	void snapshot(Snapshot& snapshot) {
+		snapshot.instructions = JitStats::get(stats.instructionsRetired);
+		snapshot.dispatched = JitStats::get(stats.blocksDispatched);
+		snapshot.misses = JitStats::get(stats.dispatcherMisses);
+		snapshot.compiled = JitStats::get(stats.blocksCompiled);
+		snapshot.compileTimeNs = JitStats::get(stats.compileTimeNs);
+		snapshot.invalidations = JitStats::get(stats.invalidations);
+		snapshot.stateInvalidations = JitStats::get(stats.stateInvalidations);
+		snapshot.frames = JitStats::get(stats.frames);
+	}
+
+	const JitStats& stats;
+	double interval;
+	FILE* file;
+	Snapshot last;
+	std::chrono::steady_clock::time_point lastReport;
+};
@@ -0,0 +1,1430 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chip8.h>
+#include <jitcommon.h>
+#include <ir.h>
+#include <irpasses.h>
+
+// Lowers IR blocks to x64. Chip8Dynarec and Chip8AOT only differ in when they compile blocks, so both go through here
+class X64Lowering {
+public:
+	// Decode, optimize and lower the block at pc into ctx's code cache
+	static fp compileBlock(JitContext& ctx, Chip8& core, uint16_t pc) {
+		CompileTimer timer(core.stats);
+
+		auto block = IRDecoder::decode(core, pc);
+		IRPasses::run(block, core.config.eliminateDeadWrites);
+
+		X64Lowering lowering(ctx, core, block);
+		auto emittedCode = lowering.lower();
+
+		for (const auto& [site, target] : lowering.exits) {
+			addLinkSite(ctx, site, target);
+		}
+		blockSlot(ctx, pc) = emittedCode;
+		ctx.codePages[pc >> pageShift] = 1;
+		linkBlock(ctx, pc, emittedCode);
+
+		JitStats::bump(core.stats.blocksCompiled);
+		JitStats::set(core.stats.codeBytesUsed, ctx.code.getSize());
+
+		PerfMap::registerBlock((const void*)emittedCode, ctx.code.rx(ctx.code.getCurr()) - (const uint8_t*)emittedCode, pc, ctx.name);
+		return emittedCode;
+	}
+
+	// Check if code cache is close to being exhausted, and make sure there's a trampoline to enter blocks through.
+	// Only call it from the dispatcher, a flush under running code would pull it out from under itself
+	static void checkCodeCache(JitContext& ctx, Chip8& core) {
+		if (!ctx.code.makeRoom(maxBlockBytes)) [[unlikely]] { //We've exhausted code cache and can't grow it, so throw it out
+			JitStats::bump(core.stats.codeBytesFlushed, ctx.code.getSize());
+			ctx.code.reset();
+			ctx.blockInfo.clear();
+			ctx.linkSites.clear();
+			ctx.returnStack.clear();
+			ctx.targetCaches.clear();
+			ctx.enter = nullptr;
+			printf("Code Cache Exhausted!!\n");
+		}
+
+		if (!ctx.enter) [[unlikely]] {
+			emitTrampoline(ctx);
+			ctx.blockTable.fill(ctx.compileStub);
+			ctx.oddBlockTable.fill(ctx.compileStub);
+			ctx.codePages.fill(0);
+		}
+	}
+
+	static fp& blockSlot(JitContext& ctx, uint16_t pc) {
+		if (pc & 1) [[unlikely]] {
+			return ctx.oddBlockTable[pc >> 1];
+		}
+		return ctx.blockTable[pc >> 1];
+	}
+
+	// Block linking
+
+	// Null if pc hasn't been compiled
+	static fp lookupBlock(JitContext& ctx, uint16_t pc) {
+		const auto block = blockSlot(ctx, pc);
+		return block != ctx.compileStub ? block : nullptr;
+	}
+
+	// Point the rel32 of a linkable exit's jmp at target. Sites are written through the RW view, targets are where
+	// code runs
+	static void patchJump(const x64Emitter& code, uint8_t* site, const void* target) {
+		const auto rel = (int32_t)((const uint8_t*)target - (code.rx(site) + 4));
+		memcpy(site, &rel, sizeof(rel));
+	}
+
+	static void addLinkSite(JitContext& ctx, uint8_t* site, uint16_t target) {
+		ctx.linkSites[target].push_back(site);
+		if (auto block = lookupBlock(ctx, target)) {
+			patchJump(ctx.code, site, (const void*)block);
+		}
+	}
+
+	// Jump every exit to pc straight into its freshly compiled block
+	static void linkBlock(JitContext& ctx, uint16_t pc, fp block) {
+		const auto sites = ctx.linkSites.find(pc);
+		if (sites == ctx.linkSites.end()) {
+			return;
+		}
+		for (auto site : sites->second) {
+			patchJump(ctx.code, site, (const void*)block);
+		}
+	}
+
+	// Send every exit to pc back through the dispatcher
+	static void unlinkBlock(JitContext& ctx, uint16_t pc) {
+		const auto sites = ctx.linkSites.find(pc);
+		if (sites == ctx.linkSites.end()) {
+			return;
+		}
+		for (auto site : sites->second) {
+			patchJump(ctx.code, site, ctx.code.rx(site + 4));
+		}
+	}
+
+	// Called from the compile stub with core.pc stored. Growing the cache is fine here, as it grows in place.
+	// Returns null when it needs flushing though, so the stub leaves that to the dispatcher
+	static fp compileFromStub(JitContext* ctx, Chip8* core) {
+		if (!ctx->code.makeRoom(maxBlockBytes)) [[unlikely]] {
+			return nullptr;
+		}
+
+		JitStats::bump(core->stats.dispatcherMisses);
+		return compileBlock(*ctx, *core, core->pc);
+	}
+
+	// Called from emitted code when a Bnnn target cache misses. Fills the next entry if pc already has a block.
+	// Returns where to go next, the compile stub if pc hasn't been compiled yet
+	static fp fillTargetCache(JitContext* ctx, TargetCache* cache, uint16_t pc) {
+		auto block = lookupBlock(*ctx, pc);
+		if (!block) {
+			return ctx->compileStub;
+		}
+
+		auto& entry = cache->entries[cache->next];
+		cache->next = (cache->next + 1) % TargetCache::size;
+
+		if (entry.pc != TargetCache::invalidPC) {
+			std::erase(ctx->linkSites[entry.pc], entry.jump);
+		}
+
+		const uint32_t imm = pc;
+		memcpy(entry.compare, &imm, sizeof(imm));
+		entry.pc = pc;
+		ctx->linkSites[pc].push_back(entry.jump);
+		patchJump(ctx->code, entry.jump, (const void*)block);
+		return block;
+	}
+
+	// Called from emitted code after Fx33/Fx55/5xy2 write ram[start..start + count), wrapping at the top of ram.
+	// Throws out every block on the pages written, and unlinks exits into them. Blocks on the page before read
+	// up to 2 bytes into the next one (see IRDecoder::decode), so they go too if those bytes were written
+	static void invalidateRange(JitContext* ctx, uint16_t start, uint16_t count) {
+		const auto first = (start - 2) & ~(pageSize - 1);
+		const auto last = (start + count - 1) | (pageSize - 1);
+
+		for (auto i = first; i <= last; i++) {
+			const auto pc = (uint16_t)i;
+			auto& block = blockSlot(*ctx, pc);
+			if (block != ctx->compileStub) {
+				block = ctx->compileStub;
+				unlinkBlock(*ctx, pc);
+			}
+		}
+		for (auto page = first; page <= last; page += pageSize) {
+			ctx->codePages[(uint16_t)page >> pageShift] = 0;
+		}
+	}
+
+private:
+	// Callee saved registers the trampoline saves, so blocks can use them freely
+	inline static const std::array<Xbyak::Reg64, 6> savedRegs = { rbp, rbx, r12, r13, r14, r15 };
+	// Host registers the register allocator hands out, all callee saved so helper calls don't clobber them
+	inline static const std::array<Xbyak::Reg8, IRPasses::allocatableRegs> hostRegs = { bl, r12b, r13b, r14b };
+
+	static constexpr int rowBytes = 2 * sizeof(uint64_t); // display rows are a left and a right word
+	static constexpr int clipRows = HIRES_HEIGHT + DISPLAY_GUARD;
+	static constexpr int clipTableBytes = clipRows * rowBytes;
+	// Most code one IR instruction lowers to. The biggest are a 16x16 sprite drawn with SSE2 a row at a time, and
+	// a DrawConst with a 15 row one behind its guard. lower() makes room for this much before each instruction
+	static constexpr size_t maxInstBytes = 4096;
+	// A page holds 16 guest instructions of up to 2 IR instructions each, then there's the terminator. Reserved
+	// before compiling, so a full cache is thrown out between blocks rather than found full in the middle of one
+	static constexpr size_t maxBlockBytes = (pageSize + 1) * maxInstBytes;
+	static constexpr size_t maxConstDrawWords = 16; // display words a DrawConst writes before it's left to lowerDraw
+
+	// Row masks for clipping whatever gets written to the display, a table per mode indexed by row. Rows past the
+	// bottom of the screen and the right words of lores rows are masked off, so they only ever get zeroes written
+	alignas(32) inline static const std::array<uint64_t, 2 * clipRows * 2> clipMask = [] {
+		std::array<uint64_t, 2 * clipRows * 2> mask = {};
+		for (auto row = 0; row < HEIGHT; row++) {
+			mask[row * 2] = ~0ull;
+		}
+		for (auto row = 0; row < HIRES_HEIGHT; row++) {
+			mask[(clipRows + row) * 2] = ~0ull;
+			mask[(clipRows + row) * 2 + 1] = ~0ull;
+		}
+		return mask;
+	}();
+
+	// Constants for splitting sprite rows across a pair of display rows' words. Sized for zmm, ymm reads the
+	// first half, which is laid out the same
+	struct alignas(64) DrawConstants {
+		// vpshufb controls putting sprite row n at the top of both words of 128 bit lane n
+		std::array<uint8_t, 64> narrowShuffle; // 8 pixel rows, a byte each
+		std::array<uint8_t, 64> wideShuffle;   // 16 pixel rows, two bytes each
+		// Added to/subtracted from startX for the left and right words' shift counts. Counts past 63 shift
+		// everything out, which takes care of sprites on the other word
+		std::array<uint64_t, 8> srlBias;
+		std::array<uint64_t, 8> sllBias;
+	};
+
+	inline static const DrawConstants drawConstants = [] {
+		DrawConstants constants;
+		constants.narrowShuffle.fill(0x80);
+		constants.wideShuffle.fill(0x80);
+		for (auto lane = 0; lane < 4; lane++) {
+			for (auto word = 0; word < 2; word++) {
+				const auto top = lane * 16 + word * 8 + 7;
+				constants.narrowShuffle[top] = lane;
+				constants.wideShuffle[top] = lane * 2;
+				constants.wideShuffle[top - 1] = lane * 2 + 1;
+			}
+			constants.srlBias[lane * 2] = 0;
+			constants.srlBias[lane * 2 + 1] = (uint64_t)-64;
+			constants.sllBias[lane * 2] = 0;
+			constants.sllBias[lane * 2 + 1] = 64;
+		}
+		return constants;
+	}();
+
+	// Fx33's digits for every byte, hundreds in the low byte, so they go into ram as a word and a byte
+	inline static const std::array<uint32_t, 256> bcdTable = [] {
+		std::array<uint32_t, 256> table;
+		for (auto value = 0; value < 256; value++) {
+			table[value] = value / 100 | (value / 10 % 10) << 8 | (value % 10) << 16;
+		}
+		return table;
+	}();
+
+	JitContext& ctx;
+	x64Emitter& code;
+	Chip8& core;
+	const IRBlock& block;
+	BlockInfo info;
+	BlockProfile* profile = nullptr;
+	std::vector<std::pair<uint8_t*, uint16_t>> exits; // linkable exits, rel32 to patch and the guest pc they go to
+
+	std::vector<Xbyak::Address> gprMem; // guest registers in the core
+	std::array<bool, 16> loaded = {};   // allocated register holds the guest register
+	std::array<bool, 16> dirty = {};    // allocated register has to be written back
+
+	const SimdLevel simd;     // which variant of the SIMD emitters to use
+	bool upperDirty = false;  // ymm/zmm registers were used since the last vzeroupper
+
+	// core.hires and core.planes at the instruction being lowered, for DrawConst. Taken from the core when the block
+	// is compiled, so they're a guess that has to be guarded until the block sets them itself
+	uint8_t drawHires;
+	uint8_t drawPlanes;
+	bool hiresSet = false;
+	bool planesSet = false;
+
+	X64Lowering(JitContext& ctx, Chip8& core, const IRBlock& block) : ctx(ctx), code(ctx.code), core(core), block(block),
+		info(ctx.code, block.startPC), simd(HostCpu::level(core.config.maxSimd)), drawHires(core.hires),
+		drawPlanes(core.planes) {
+		for (auto i = 0; i < 16; i++) {
+			gprMem.push_back(byte[rbp + getOffset(&core.gpr[i])]);
+		}
+	}
+
+	// The trampoline's exit as the emitter sees it, for direct jumps to it
+	const void* exitRW() const {
+		return code.rw(ctx.exit);
+	}
+
+	// Get offset from a variable to the cpu core
+	uintptr_t getOffset(const void* variable) const {
+		return (uintptr_t)variable - (uintptr_t)&core;
+	}
+
+	static void emitTrampoline(JitContext& ctx) {
+		auto& code = ctx.code;
+		const auto start = code.getCurr();
+
+		// int enter(fp block, Chip8* core, int cycleBudget)
+		// r15d holds the budget left while blocks chain into each other, the budget it started at is kept at rsp + 32
+		ctx.enter = (JitContext::enterfp)code.rx(code.getCurr());
+		for (const auto& reg : savedRegs) {
+			code.push(reg);
+		}
+		code.sub(rsp, 40); // shadow space for helper calls, also leaves rsp 16 byte aligned at call sites
+		code.mov(rbp, abiParam2);
+		code.mov(r15d, abiParam3.cvt32());
+		code.mov(dword[rsp + 32], r15d);
+		code.jmp(abiParam1);
+
+		// Blocks jump here once they've taken their cycles off the budget, return cycles taken
+		ctx.exit = code.rx(code.getCurr());
+		code.mov(eax, dword[rsp + 32]);
+		code.sub(eax, r15d);
+		code.add(rsp, 40);
+		for (auto it = savedRegs.rbegin(); it != savedRegs.rend(); ++it) {
+			code.pop(*it);
+		}
+		code.ret();
+
+		// Every uncompiled pc points here. Compiles core.pc's block and jumps into it
+		Xbyak::Label flush;
+		ctx.compileStub = (fp)code.rx(code.getCurr());
+		code.mov(abiParam1, (uintptr_t)&ctx);
+		code.mov(abiParam2, rbp);
+		code.mov(rax, (uintptr_t)&compileFromStub);
+		code.call(rax);
+		code.test(rax, rax);
+		code.jz(flush);
+		code.jmp(rax);
+		code.L(flush);
+		code.jmp(code.rw(ctx.exit));
+
+		PerfMap::registerCode(code.rx(start), code.getCurr() - start, ctx.name);
+	}
+
+	fp lower() {
+		auto emittedCode = (fp)code.rx(code.getCurr());
+		if (core.profiler.enabled) [[unlikely]] {
+			profile = core.profiler.addBlock(block.startPC, ctx.name);
+			profile->endPC = block.endPC;
+			profile->instrs = block.instrs;
+			profile->longOperands = block.longOperands;
+		}
+
+		auto inst = block.insts.begin();
+		for (auto i = 0; i < block.instrs.size(); i++) {
+			info.beginInstr(code, block.instrs[i]);
+			for (; inst != block.insts.end() && inst->guestIndex == i; ++inst) {
+				// Grows in place, so it's fine mid block. Can't fail after compileBlock's caller reserved maxBlockBytes
+				if (!code.makeRoom(maxInstBytes)) {
+					printf("No room in the code cache for block %04X\n", block.startPC);
+					exit(1);
+				}
+
+				const auto start = code.getSize();
+				if (inst->isTerminator()) {
+					lowerTerminator(*inst);
+				}
+				else {
+					lowerInst(*inst);
+				}
+				assert(code.getSize() - start <= maxInstBytes);
+			}
+		}
+
+		info.endPC = block.endPC; // F000 nnnn is 4 bytes
+		info.longOperands = block.longOperands;
+		info.end(code);
+		ctx.blockInfo.push_back(std::move(info));
+		return emittedCode;
+	}
+
+	// Bump this block's execution (and optionally cycle) counters. Only emitted when profiling
+	void emitProfileCounters() {
+		code.mov(rax, (uintptr_t)&profile->executions);
+		code.inc(qword[rax]);
+		if (core.profiler.countCycles) {
+			code.add(qword[rax + ((uintptr_t)&profile->cycles - (uintptr_t)&profile->executions)], block.cycles());
+		}
+	}
+
+	// Exits. Every way out of a block writes back dirty registers and takes the block's cycles off the budget.
+	// Exits to a known pc can be linked: while there's budget left they jump straight into the next block,
+	// through a jmp that points at the code right after it until the next block is compiled. That code goes through
+	// the block table, so the compile stub picks it up without a trip through the dispatcher
+
+	void beginExit() {
+		clearUpper(false); // this path leaves the block, the rest of it still has them dirty
+		for (auto reg = 0; reg < 16; reg++) { // other exits still need to write them back, so they stay dirty
+			if (dirty[reg]) {
+				code.mov(gprMem[reg], hostRegs[block.hostReg[reg]]);
+			}
+		}
+
+		if (profile) [[unlikely]] {
+			emitProfileCounters();
+		}
+		code.sub(r15d, block.cycles());
+	}
+
+	void emitLinkedExit(uint16_t target) {
+		beginExit();
+		emitLink(target);
+	}
+
+	// Expects flags from the budget, jumps to target's block or the dispatcher if the budget's gone
+	void emitLink(uint16_t target) {
+		Xbyak::Label unlinked;
+
+		code.jle(unlinked); // out of budget, back to the dispatcher
+		code.jmp(unlinked, Xbyak::CodeGenerator::T_NEAR); // patched by linkBlock
+		exits.emplace_back((uint8_t*)code.getCurr() - 4, target);
+
+		code.L(unlinked); // flags still hold the budget
+		code.mov(word[rbp + getOffset(&core.pc)], target);
+		code.jle(exitRW(), Xbyak::CodeGenerator::T_NEAR);
+		code.mov(rax, (uintptr_t)&blockSlot(ctx, target)); // not compiled yet, so this is the compile stub
+		code.jmp(qword[rax]);
+	}
+
+	// For exits that already stored pc
+	void emitDispatcherExit() {
+		beginExit();
+		code.jmp(exitRW());
+	}
+
+	// Register allocation
+
+	bool inHostReg(int reg) const {
+		return block.hostReg[reg] >= 0;
+	}
+
+	// Operand to read a guest register through, loads its host register on first use
+	const Xbyak::Operand& readGpr(int reg) {
+		if (!inHostReg(reg)) {
+			return gprMem[reg];
+		}
+
+		const auto& hostReg = hostRegs[block.hostReg[reg]];
+		if (!loaded[reg]) {
+			code.mov(hostReg, gprMem[reg]);
+			loaded[reg] = true;
+		}
+		return hostReg;
+	}
+
+	// Operand to write a guest register through. Host registers are written back at the end of the block
+	const Xbyak::Operand& writeGpr(int reg) {
+		if (!inHostReg(reg)) {
+			return gprMem[reg];
+		}
+
+		loaded[reg] = dirty[reg] = true;
+		return hostRegs[block.hostReg[reg]];
+	}
+
+	const Xbyak::Operand& modifyGpr(int reg) {
+		readGpr(reg);
+		return writeGpr(reg);
+	}
+
+	// Store dirty host registers in mask back to the core
+	void writeBack(uint16_t mask = 0xffff) {
+		for (auto reg = 0; reg < 16; reg++) {
+			if ((mask & (1 << reg)) && dirty[reg]) {
+				code.mov(gprMem[reg], hostRegs[block.hostReg[reg]]);
+				dirty[reg] = false;
+			}
+		}
+	}
+
+	// Registers in mask were written in the core behind our back, reload them on next use
+	void discard(uint16_t mask) {
+		for (auto reg = 0; reg < 16; reg++) {
+			if (mask & (1 << reg)) {
+				loaded[reg] = dirty[reg] = false;
+			}
+		}
+	}
+
+	// Source operand for a two operand op on dst, goes through al if both would be memory
+	const Xbyak::Operand& source(const Xbyak::Operand& dst, int reg) {
+		const auto& src = readGpr(reg);
+		if (dst.isMEM() && src.isMEM()) {
+			code.mov(al, src);
+			return al;
+		}
+		return src;
+	}
+
+	void move(const Xbyak::Operand& dst, const Xbyak::Operand& src) {
+		if (dst.isMEM() && src.isMEM()) {
+			code.mov(al, src);
+			code.mov(dst, al);
+		}
+		else {
+			code.mov(dst, src);
+		}
+	}
+
+	// Helpers called from emitted code
+
+	static uint8_t randomByte(Chip8* core) {
+		return core->randomByte();
+	}
+
+	static void invalidInstruction(Chip8* core, uint16_t instr) {
+		printf("Unimplemented instr - %04X\n", instr);
+		exit(1);
+	}
+
+	// Legacy SSE in compiled C++ stalls on dirty upper halves, so they're cleared before helpers and on the way out
+	// of the block rather than after every AVX instruction
+	void clearUpper(bool clean = true) {
+		if (upperDirty) {
+			code.vzeroupper();
+			upperDirty = !clean;
+		}
+	}
+
+	void callHelper(const void* helper) {
+		clearUpper();
+		code.mov(rax, (uintptr_t)helper);
+		code.call(rax);
+	}
+
+	// Lowering
+
+	void lowerInst(const IRInst& inst) {
+		switch (inst.op) {
+		case IROp::LoadImm:    code.mov(writeGpr(inst.x), inst.imm);                           break;
+		case IROp::Copy:       move(writeGpr(inst.x), readGpr(inst.y));                        break;
+		case IROp::AddImm:     code.add(modifyGpr(inst.x), inst.imm);                          break;
+		case IROp::Alu:        lowerAlu(inst);                                                 break;
+		case IROp::Rand:       lowerRand(inst);                                                break;
+		case IROp::SetIndex:   code.mov(word[rbp + getOffset(&core.index)], inst.imm);         break;
+		case IROp::AddIndex:   lowerAddIndex(inst);                                            break;
+		case IROp::FontIndex:  lowerFontIndex(inst);                                           break;
+		case IROp::ReadDelay:  move(writeGpr(inst.x), byte[rbp + getOffset(&core.delay)]);     break;
+		case IROp::WriteDelay: move(byte[rbp + getOffset(&core.delay)], readGpr(inst.x));      break;
+		case IROp::WriteSound: move(byte[rbp + getOffset(&core.sound)], readGpr(inst.x));      break;
+		case IROp::StoreBCD:   lowerStoreBCD(inst);                                            break;
+		case IROp::StoreRegs:  lowerStoreRegs(inst);                                           break;
+		case IROp::LoadRegs:   lowerLoadRegs(inst);                                            break;
+		case IROp::Invalidate: lowerInvalidate(inst);                                          break;
+		case IROp::Clear:      lowerClear(inst);                                               break;
+		case IROp::Draw:       lowerDraw(inst);                                                break;
+		case IROp::DrawConst:  lowerDrawConst(inst);                                           break;
+		case IROp::Scroll:     lowerScroll(inst);                                              break;
+		case IROp::SetMode:
+			code.mov(byte[rbp + getOffset(&core.hires)], inst.imm);
+			lowerClear(inst);
+			drawHires = (uint8_t)inst.imm;
+			hiresSet = true;
+			break;
+		case IROp::SetPlanes:
+			code.mov(byte[rbp + getOffset(&core.planes)], inst.imm);
+			drawPlanes = (uint8_t)inst.imm;
+			planesSet = true;
+			break;
+		default:
+			printf("Can't lower IR op %d\n", (int)inst.op);
+			exit(1);
+		}
+	}
+
+	void lowerAlu(const IRInst& inst) { //8xy1-8xyE
+		const auto op = (AluOp)inst.sub;
+
+		if (op == AluOp::SubN) { // Vx = Vy - Vx, result goes in before the flag in case x is F
+			code.mov(cl, readGpr(inst.y));
+			code.sub(cl, readGpr(inst.x));
+			code.seta(dl); // set not borrow
+			code.mov(writeGpr(inst.x), cl);
+			if (inst.writesFlag) {
+				code.mov(writeGpr(0xf), dl);
+			}
+			return;
+		}
+
+		const auto& dst = modifyGpr(inst.x);
+		switch (op) {
+		case AluOp::Or:  code.or_(dst, source(dst, inst.y));  break;
+		case AluOp::And: code.and_(dst, source(dst, inst.y)); break;
+		case AluOp::Xor: code.xor_(dst, source(dst, inst.y)); break;
+		case AluOp::Add: code.add(dst, source(dst, inst.y));  break;
+		case AluOp::Sub: code.sub(dst, source(dst, inst.y));  break;
+		case AluOp::Shr: code.shr(dst, 1);                    break;
+		case AluOp::Shl: code.shl(dst, 1);                    break;
+		default: break;
+		}
+
+		if (inst.writesFlag) {
+			if (op == AluOp::Sub) {
+				code.seta(writeGpr(0xf)); // set not borrow
+			}
+			else {
+				code.setc(writeGpr(0xf)); // set carry, or the bit shifted out
+			}
+		}
+	}
+
+	void lowerRand(const IRInst& inst) { //Cxkk
+		code.mov(abiParam1, rbp);
+		callHelper((const void*)&randomByte);
+		code.and_(al, inst.imm);
+		code.mov(writeGpr(inst.x), al);
+	}
+
+	void lowerAddIndex(const IRInst& inst) { //Fx1E
+		code.movzx(ecx, readGpr(inst.x));
+		code.add(word[rbp + getOffset(&core.index)], cx);
+	}
+
+	void lowerFontIndex(const IRInst& inst) { //Fx29
+		code.movzx(ecx, readGpr(inst.x));
+		code.lea(ecx, ptr[ecx * 4 + ecx]); // multiply cx by 5
+		code.mov(word[rbp + getOffset(&core.index)], cx);
+	}
+
+	void lowerStoreBCD(const IRInst& inst) { //Fx33
+		// eax: gpr, then its digits from bcdTable
+		// rdx: pointer to bcdTable
+		// r8: core.index
+		code.movzx(eax, readGpr(inst.x));
+		code.movzx(r8, word[rbp + getOffset(&core.index)]);
+		code.mov(rdx, (uintptr_t)bcdTable.data());
+		code.mov(eax, dword[rdx + rax * 4]);
+
+		code.mov(word[rbp + getOffset(core.ram.data()) + r8], ax); // write gpr / 100 and (gpr / 10) % 10 into ram[index..]
+		code.shr(eax, 16);
+		code.mov(byte[rbp + getOffset(core.ram.data()) + r8 + 2], al); // write gpr % 10 into ram[index + 2]
+	}
+
+	// Guest register the i'th byte of a StoreRegs/LoadRegs range goes with
+	static int rangeReg(const IRInst& inst, int i) {
+		return inst.x <= inst.y ? inst.x + i : inst.x - i;
+	}
+
+	void lowerStoreRegs(const IRInst& inst) { //Fx55, 5xy2
+		// rcx: pointer to core.ram.data() + core.index
+		// r8:  pointer to core.gpr.data()
+		// r9b: byte data
+		writeBack(inst.regRange());
+
+		code.movzx(rcx, word[rbp + getOffset(&core.index)]); //load index pointer
+		code.lea(rcx, byte[rbp + getOffset(core.ram.data()) + rcx]);
+		code.lea(r8, byte[rbp + getOffset(core.gpr.data())]);
+
+		const auto count = std::abs(inst.x - inst.y) + 1;
+		if (inst.x <= inst.y) {
+			copyBytes(rcx, r8 + inst.x, count);
+			return;
+		}
+
+		for (auto i = 0; i < count; i++) { // 5xy2 backwards
+			code.mov(r9b, byte[r8 + rangeReg(inst, i)]); // load byte from gpr[counter]
+			code.mov(byte[rcx + i], r9b); // write byte to ram[index + counter]
+		}
+	}
+
+	// same thing above but with pointers switched
+	void lowerLoadRegs(const IRInst& inst) { //Fx65, 5xy3
+		code.movzx(rcx, word[rbp + getOffset(&core.index)]); //load index pointer
+		code.lea(rcx, byte[rbp + getOffset(core.ram.data()) + rcx]);
+		code.lea(r8, byte[rbp + getOffset(core.gpr.data())]);
+
+		const auto count = std::abs(inst.x - inst.y) + 1;
+		if (inst.x <= inst.y) {
+			copyBytes(r8 + inst.x, rcx, count);
+		} else {
+			for (auto i = 0; i < count; i++) { // 5xy3 backwards
+				code.mov(r9b, byte[rcx + i]); // load byte from ram[index + counter]
+				code.mov(byte[r8 + rangeReg(inst, i)], r9b); // write byte to gpr[counter]
+			}
+		}
+
+		discard(inst.regRange());
+	}
+
+	// Copies count (up to 16) bytes from src to dst, trashes rax, rdx and xmm0. 16 go in one xmm, anything else in
+	// two loads and two stores of the biggest size that fits, overlapping in the middle. Bytes outside either range
+	// are never touched, they're other guest registers
+	void copyBytes(const Xbyak::RegExp& dst, const Xbyak::RegExp& src, int count) {
+		if (count == 16) {
+			if (simd == SimdLevel::SSE2) {
+				code.movdqu(xmm0, xword[src]);
+				code.movdqu(xword[dst], xmm0);
+			} else { // legacy SSE would stall if the upper halves are dirty
+				code.vmovdqu(xmm0, xword[src]);
+				code.vmovdqu(xword[dst], xmm0);
+			}
+			return;
+		}
+
+		const auto size = count >= 8 ? 8 : count >= 4 ? 4 : count >= 2 ? 2 : 1;
+		const auto first = rax.changeBit(size * 8);
+		const auto last = rdx.changeBit(size * 8);
+		code.mov(first, ptr[src]);
+		if (count > size) {
+			code.mov(last, ptr[src + count - size]);
+		}
+		code.mov(ptr[dst], first);
+		if (count > size) {
+			code.mov(ptr[dst + count - size], last);
+		}
+	}
+
+	// Invalidates every page ram[index..index + imm) touches, if a block starts on one. The pages invalidateRange
+	// would throw out (the one before index - 2 through the last written) are at most two, as imm is 16 at most
+	void lowerInvalidate(const IRInst& inst) {
+		// eax: page of the last byte written
+		// edx: page of index - 2
+		// r8 : pointer to ctx.codePages
+		static constexpr int pageMask = RAM_SIZE / pageSize - 1;
+		Xbyak::Label noCode;
+
+		code.movzx(eax, word[rbp + getOffset(&core.index)]);
+		code.lea(edx, ptr[rax - 2]);
+		code.add(eax, inst.imm - 1);
+		code.shr(edx, pageShift);
+		code.and_(edx, pageMask); // wraps at the bottom of ram...
+		code.shr(eax, pageShift);
+		code.and_(eax, pageMask); // ...and at the top
+		code.mov(r8, (uintptr_t)ctx.codePages.data());
+		code.movzx(edx, byte[r8 + rdx]);
+		code.or_(dl, byte[r8 + rax]);
+		code.jz(noCode, Xbyak::CodeGenerator::T_NEAR);
+
+		code.inc(qword[rbp + getOffset(&core.stats.invalidations)]);
+		code.mov(abiParam1, (uintptr_t)&ctx);
+		code.movzx(abiParam2.cvt32(), word[rbp + getOffset(&core.index)]);
+		code.mov(abiParam3.cvt32(), inst.imm);
+		const auto dirtyUpper = upperDirty; // the vzeroupper before the call only runs when it's taken
+		callHelper((const void*)&invalidateRange);
+		upperDirty = dirtyUpper;
+		code.L(noCode);
+	}
+
+	// Emit body once and run it for every plane selected in core.planes, with plane pointing at the plane's copy
+	// of whatever it pointed into the first plane. Trashes mask
+	template <typename F>
+	void forEachPlane(const Xbyak::Reg32& mask, const Xbyak::Reg64& plane, F&& body) {
+		Xbyak::Label loop, next;
+		code.movzx(mask, byte[rbp + getOffset(&core.planes)]);
+		code.L(loop);
+		code.shr(mask, 1);
+		code.jnc(next, Xbyak::CodeGenerator::T_NEAR);
+		body();
+		code.L(next);
+		code.add(plane, PLANE_WORDS * sizeof(uint64_t));
+		code.test(mask, mask);
+		code.jnz(loop, Xbyak::CodeGenerator::T_NEAR);
+	}
+
+	void lowerClear(const IRInst& inst) { //00E0, and every plane on a mode switch
+		//display = 64 rows * 16 bytes, guard rows are already clear
+		//a store covers 16, 32 or 64 bytes depending on the SIMD level
+		const auto clearPlane = [&](const Xbyak::RegExp& plane) {
+			for (auto offset = 0; offset < HIRES_HEIGHT * rowBytes; ) {
+				switch (simd) {
+				case SimdLevel::AVX512: code.vmovdqu64(zword[plane + offset], zmm0); offset += 64; break;
+				case SimdLevel::AVX2:   code.vmovdqa(yword[plane + offset], ymm0);   offset += 32; break;
+				case SimdLevel::SSE2:   code.movdqa(xword[plane + offset], xmm0);    offset += 16; break;
+				}
+			}
+		};
+
+		switch (simd) {
+		case SimdLevel::AVX512: code.vpxorq(zmm0, zmm0, zmm0); break;
+		case SimdLevel::AVX2:   code.vpxor(ymm0, ymm0, ymm0);  break;
+		case SimdLevel::SSE2:   code.pxor(xmm0, xmm0);         break;
+		}
+
+		if (inst.op == IROp::SetMode) {
+			for (auto plane = 0; plane < DISPLAY_PLANES; plane++) {
+				clearPlane(rbp + getOffset(core.display.data() + plane * PLANE_WORDS));
+			}
+		}
+		else {
+			code.lea(r9, ptr[rbp + getOffset(core.display.data())]);
+			forEachPlane(ecx, r9, [&] { clearPlane(r9); });
+		}
+		upperDirty |= simd != SimdLevel::SSE2;
+	}
+
+	// Point reg at the clip masks for the current mode, trashes rax
+	void loadClipMask(const Xbyak::Reg64& reg) {
+		code.movzx(eax, byte[rbp + getOffset(&core.hires)]);
+		code.imul(eax, eax, clipTableBytes);
+		code.mov(reg, (uintptr_t)clipMask.data());
+		code.add(reg, rax);
+	}
+
+	// Dxyn, Dxy0 draws a 16x16 sprite. Sprite rows are split across the left and right words of their display row
+	// by shifting right by startX and left by 64 - startX, with counts past 63 shifting everything out.
+	// Takes 1 (SSE2), 2 (AVX2) or 4 (AVX-512) rows at a time. Also DrawConst's fallback, with its operands as immediates
+	void lowerDraw(const IRInst& inst) {
+		// rax: temp
+		// rcx: startX
+		// rdx: startY, then its row's offset into the display
+		// rcx: selected planes left, once the shift counts are built
+		// r8 : pointer to core.ram[core.index], then to the next plane's sprite
+		// r9 : pointer to the display row at startY in the plane being drawn
+		// r10: pointer to the clip mask of the row at startY
+		// r11: collisions
+
+		const auto draw = inst.op == IROp::DrawConst ? IRInst { .op = IROp::Draw, .imm = inst.sub, .writesFlag = inst.writesFlag } : inst;
+		if (inst.op == IROp::DrawConst) {
+			code.mov(ecx, inst.x);
+			code.mov(edx, inst.y);
+		} else {
+			code.movzx(ecx, readGpr(inst.x)); // load startX
+			code.movzx(edx, readGpr(inst.y)); // load startY
+		}
+		code.movzx(eax, byte[rbp + getOffset(&core.hires)]);
+		code.shl(eax, 6);
+		code.or_(eax, WIDTH - 1);
+		code.and_(ecx, eax); // startX &= 127 in hires, 63 in lores
+		code.shr(eax, 1);
+		code.and_(edx, eax); // startY &= 63 in hires, 31 in lores
+		code.shl(edx, 4);    // * rowBytes
+		if (inst.writesFlag) {
+			code.xor_(r11d, r11d);
+		}
+
+		loadClipMask(r10);
+		code.add(r10, rdx);
+		code.lea(r9, ptr[rbp + getOffset(core.display.data()) + rdx]);
+		code.movzx(eax, word[rbp + getOffset(&core.index)]); // load core.index
+		code.lea(r8, ptr[rbp + getOffset(core.ram.data()) + rax]);
+
+		switch (simd) {
+		case SimdLevel::AVX512: lowerDrawAVX512(draw); break;
+		case SimdLevel::AVX2:   lowerDrawAVX2(draw);   break;
+		case SimdLevel::SSE2:   lowerDrawSSE2(draw);   break;
+		}
+
+		if (inst.writesFlag) {
+			code.mov(writeGpr(0xf), r11b); // set on collision
+		}
+	}
+
+	// Dxyn with the position and sprite address known. The sprite is split across display words at compile time
+	// and xored straight into fixed display rows, guarded by the mode, the planes and the sprite bytes all still being
+	// what they were when the block was compiled. Anything else goes through lowerDraw, and so do 16x16 sprites and
+	// draws to both planes, which would take more code specialized than the generic draw behind the guard does
+	void lowerDrawConst(const IRInst& inst) {
+		// rax: sprite bits for a display word
+		// rdx: temp
+		// r11: collisions
+
+		const auto wide = inst.sub == 0;
+		const auto bytesPerLine = wide ? 2 : 1;
+		const auto lines = wide ? 16 : inst.sub;
+		const auto width = drawHires ? HIRES_WIDTH : WIDTH;
+		const auto height = drawHires ? HIRES_HEIGHT : HEIGHT;
+		const auto startX = inst.x & (width - 1);
+		const auto startY = inst.y & (height - 1);
+		if (wide || (drawPlanes & (drawPlanes - 1))) {
+			lowerDraw(inst);
+			return;
+		}
+
+		// Same as Chip8Interpreter::DXYN, less the words with nothing to draw
+		std::vector<std::pair<uintptr_t, uint64_t>> words; // offset into the core, bits to xor in
+		int sprite = inst.imm; // doesn't wrap, same as lowerDraw
+		for (auto plane = 0; plane < DISPLAY_PLANES; plane++) {
+			if (!(drawPlanes & (1 << plane))) {
+				continue;
+			}
+
+			for (auto y = 0; y < lines && startY + y < height; y++) {
+				const uint64_t spriteLine = wide ? ((uint64_t)core.ram[sprite + y * 2] << 56) | ((uint64_t)core.ram[sprite + y * 2 + 1] << 48)
+					: (uint64_t)core.ram[sprite + y] << 56;
+				const uint64_t left = startX < 64 ? spriteLine >> startX : 0;
+				const uint64_t right = !drawHires || startX == 0 ? 0 : startX < 64 ? spriteLine << (64 - startX) : spriteLine >> (startX - 64);
+
+				const auto row = core.display.data() + plane * PLANE_WORDS + (startY + y) * 2;
+				if (left) {
+					words.push_back({ getOffset(row), left });
+				}
+				if (right) {
+					words.push_back({ getOffset(row + 1), right });
+				}
+			}
+			sprite += lines * bytesPerLine;
+		}
+
+		if (words.size() > maxConstDrawWords) { // not worth the code
+			lowerDraw(inst);
+			return;
+		}
+
+		Xbyak::Label generic, done;
+		if (!hiresSet) {
+			code.cmp(byte[rbp + getOffset(&core.hires)], drawHires);
+			code.jne(generic, Xbyak::CodeGenerator::T_NEAR);
+		}
+		if (!planesSet) {
+			code.cmp(byte[rbp + getOffset(&core.planes)], drawPlanes);
+			code.jne(generic, Xbyak::CodeGenerator::T_NEAR);
+		}
+		guardRam(inst.imm, sprite - inst.imm, generic);
+
+		if (inst.writesFlag) {
+			code.xor_(r11d, r11d);
+		}
+		for (const auto& [offset, bits] : words) {
+			code.mov(rax, bits);
+			if (inst.writesFlag) {
+				code.mov(rdx, rax);
+				code.and_(rdx, qword[rbp + offset]); // test for collisions
+				code.or_(r11, rdx);
+			}
+			code.xor_(qword[rbp + offset], rax);
+		}
+		if (inst.writesFlag) {
+			code.test(r11, r11);
+			code.setnz(writeGpr(0xf)); // set on collision
+		}
+		code.jmp(done, Xbyak::CodeGenerator::T_NEAR);
+
+		code.L(generic);
+		lowerDraw(inst);
+		code.L(done);
+	}
+
+	// Jumps to mismatch unless ram[start..start + count) still holds what it does now. Sprites at the top of ram
+	// run on into RAM_GUARD rather than wrapping, like lowerDraw's
+	void guardRam(int start, int count, Xbyak::Label& mismatch) {
+		for (auto offset = 0; offset < count; ) {
+			const auto address = rbp + getOffset(core.ram.data() + start + offset);
+			const auto bytes = count - offset >= 8 ? 8 : count - offset >= 4 ? 4 : count - offset >= 2 ? 2 : 1;
+			uint64_t expected = 0;
+			memcpy(&expected, core.ram.data() + start + offset, bytes);
+
+			switch (bytes) {
+			case 8:
+				code.mov(rax, expected);
+				code.cmp(qword[address], rax);
+				break;
+			case 4: code.cmp(dword[address], (uint32_t)expected); break;
+			case 2: code.cmp(word[address], (uint16_t)expected);  break;
+			case 1: code.cmp(byte[address], (uint8_t)expected);   break;
+			}
+			code.jne(mismatch, Xbyak::CodeGenerator::T_NEAR);
+			offset += bytes;
+		}
+	}
+
+	void lowerDrawAVX2(const IRInst& inst) {
+		// ymm0: sprite rows, two per register, each split across the words of its display row
+		// ymm1: display rows
+		// ymm2: shuffle control
+		// ymm3: right shift counts for each word
+		// ymm4: left shift counts for each word
+
+		const auto wide = inst.imm == 0;
+		const auto bytesPerLine = wide ? 2 : 1;
+		auto lines = wide ? 16 : inst.imm; // how many lines we're drawing
+		auto index = 0;                    // to index into the sprite and the display
+
+		code.mov(rax, (uintptr_t)&drawConstants);
+		code.vmovq(xmm1, rcx);
+		code.vpbroadcastq(ymm1, xmm1);
+		code.vpaddq(ymm3, ymm1, yword[rax + offsetof(DrawConstants, srlBias)]);
+		code.vmovdqa(ymm4, yword[rax + offsetof(DrawConstants, sllBias)]);
+		code.vpsubq(ymm4, ymm4, ymm1);
+		code.vmovdqa(ymm2, yword[rax + (wide ? offsetof(DrawConstants, wideShuffle) : offsetof(DrawConstants, narrowShuffle))]);
+
+		// Called with ymm registers for 2 lines, xmm for 1
+		const auto drawLines = [&](const auto& sprite, const auto& display, const auto& shuffle, const auto& srlCounts,
+			const auto& sllCounts, const Xbyak::Address& clip, const Xbyak::Address& row) {
+			code.vpbroadcastd(sprite, dword[r8 + index * bytesPerLine]); // sprite bytes for 2 lines into both lanes
+			code.vpshufb(sprite, sprite, shuffle);
+			code.vpsrlvq(display, sprite, srlCounts);
+			code.vpsllvq(sprite, sprite, sllCounts);
+			code.vpor(sprite, sprite, display); // split across the left and right words
+			code.vpand(sprite, sprite, clip);   // clip lines past the bottom, and past the right edge in lores
+
+			code.vmovdqu(display, row);
+			if (inst.writesFlag) {
+				code.vptest(sprite, display); // test for collisions
+				code.setnz(al);
+				code.or_(r11b, al);
+			}
+
+			code.vpxor(display, display, sprite); // displaylines ^= spritelines
+			code.vmovdqu(row, display);
+		};
+
+		// With more than one plane selected, each plane's sprite follows the previous one's in ram
+		forEachPlane(ecx, r9, [&] {
+			while (lines >= 2) {
+				drawLines(ymm0, ymm1, ymm2, ymm3, ymm4, yword[r10 + index * rowBytes], yword[r9 + index * rowBytes]);
+				index += 2; // 2 display lines have been drawn to screen
+				lines -= 2;
+			}
+
+			if (lines > 0) { //compensate for odd line
+				drawLines(xmm0, xmm1, xmm2, xmm3, xmm4, xword[r10 + index * rowBytes], xword[r9 + index * rowBytes]);
+			}
+
+			code.add(r8, (wide ? 16 : inst.imm) * bytesPerLine);
+		});
+
+		upperDirty = true;
+	}
+
+	void lowerDrawAVX512(const IRInst& inst) {
+		// zmm0: sprite rows, four per register, each split across the words of its display row
+		// zmm1: display rows
+		// zmm2: shuffle control
+		// zmm3: right shift counts for each word
+		// zmm4: left shift counts for each word
+		// k1  : the words of the rows left over once the rest went 4 at a time
+		// k2  : words that collided
+
+		const auto wide = inst.imm == 0;
+		const auto bytesPerLine = wide ? 2 : 1;
+		const auto lines = wide ? 16 : inst.imm;
+
+		code.mov(rax, (uintptr_t)&drawConstants);
+		code.vmovq(xmm1, rcx);
+		code.vpbroadcastq(zmm1, xmm1);
+		code.vpaddq(zmm3, zmm1, zword[rax + offsetof(DrawConstants, srlBias)]);
+		code.vmovdqa64(zmm4, zword[rax + offsetof(DrawConstants, sllBias)]);
+		code.vpsubq(zmm4, zmm4, zmm1);
+		code.vmovdqa64(zmm2, zword[rax + (wide ? offsetof(DrawConstants, wideShuffle) : offsetof(DrawConstants, narrowShuffle))]);
+		if (lines % 4) {
+			code.mov(eax, (1 << (lines % 4 * 2)) - 1);
+			code.kmovw(k1, eax);
+		}
+
+		// Masked off words aren't read or written, so a partial group can't touch the rows after the sprite
+		const auto drawLines = [&](int index, bool partial) {
+			const auto sprite = partial ? zmm0 | k1 | T_z : zmm0;
+			const auto display = partial ? zmm1 | k1 | T_z : zmm1;
+			const auto row = zword[r9 + index * rowBytes];
+
+			code.vpbroadcastq(zmm0, qword[r8 + index * bytesPerLine]); // sprite bytes for 4 lines into every lane
+			code.vpshufb(zmm0, zmm0, zmm2);
+			code.vpsrlvq(zmm1, zmm0, zmm3);
+			code.vpsllvq(zmm0, zmm0, zmm4);
+			code.vporq(zmm0, zmm0, zmm1);
+			code.vpandq(sprite, zmm0, zword[r10 + index * rowBytes]);
+
+			code.vmovdqu64(display, row);
+			if (inst.writesFlag) {
+				code.vptestmq(k2, zmm0, zmm1);
+				code.kortestw(k2, k2);
+				code.setnz(al);
+				code.or_(r11b, al);
+			}
+
+			code.vpxorq(zmm1, zmm1, zmm0);
+			code.vmovdqu64(partial ? row | k1 : row, zmm1);
+		};
+
+		forEachPlane(ecx, r9, [&] {
+			for (auto index = 0; index < lines; index += 4) {
+				drawLines(index, lines - index < 4);
+			}
+			code.add(r8, lines * bytesPerLine);
+		});
+
+		upperDirty = true;
+	}
+
+	void lowerDrawSSE2(const IRInst& inst) {
+		// rax: sprite row, then collisions
+		// xmm0: sprite row, split across the words of its display row
+		// xmm1: display row
+		// xmm2: temp, then collisions
+		// xmm3: right shift count for the left word
+		// xmm4, xmm5: left and right shift counts for the right word. SSE2 shifts both words by the same count,
+		// so each word is shifted on its own and they're unpacked together
+
+		const auto wide = inst.imm == 0;
+		const auto lines = wide ? 16 : inst.imm;
+
+		code.movq(xmm3, rcx);
+		code.mov(eax, 64);
+		code.sub(rax, rcx);
+		code.movq(xmm4, rax); // 64 - startX
+		code.lea(rax, ptr[rcx - 64]);
+		code.movq(xmm5, rax); // startX - 64, past 63 unless startX is in the right word
+
+		forEachPlane(ecx, r9, [&] {
+			for (auto index = 0; index < lines; index++) {
+				if (wide) {
+					code.movzx(eax, word[r8 + index * 2]);
+					code.rol(ax, 8); // first byte is the left one
+					code.shl(rax, 48);
+				} else {
+					code.movzx(eax, byte[r8 + index]);
+					code.shl(rax, 56);
+				}
+
+				code.movq(xmm0, rax);
+				code.movdqa(xmm1, xmm0);
+				code.movdqa(xmm2, xmm0);
+				code.psrlq(xmm0, xmm3);
+				code.psllq(xmm1, xmm4);
+				code.psrlq(xmm2, xmm5);
+				code.por(xmm1, xmm2);
+				code.punpcklqdq(xmm0, xmm1); // left word, right word
+				code.pand(xmm0, xword[r10 + index * rowBytes]);
+
+				code.movdqu(xmm1, xword[r9 + index * rowBytes]);
+				if (inst.writesFlag) {
+					code.movdqa(xmm2, xmm1);
+					code.pand(xmm2, xmm0);
+				}
+				code.pxor(xmm1, xmm0);
+				code.movdqu(xword[r9 + index * rowBytes], xmm1);
+
+				if (inst.writesFlag) {
+					code.pshufd(xmm0, xmm2, 0x4e); // swap the words to or them together
+					code.por(xmm0, xmm2);
+					code.movq(rax, xmm0);
+					code.test(rax, rax);
+					code.setnz(al);
+					code.or_(r11b, al);
+				}
+			}
+			code.add(r8, lines * (wide ? 2 : 1));
+		});
+	}
+
+	void lowerScroll(const IRInst& inst) { //00Cn, 00FB, 00FC
+		// rax: temp
+		// rcx: offset of the display rows being written
+		// rdx: rows left to move
+		// r9 : pointer to the plane being scrolled
+		// r10: pointer to the clip masks
+		// r11: selected planes left
+		// ymm0, ymm1: display rows, two at a time (a row at a time in xmm0, xmm1 with SSE2)
+
+		// Every visible row is clipped on the way back, which keeps lores rows past the screen and right words clear
+		const auto pixels = inst.imm;
+		if (pixels == 0) {
+			return;
+		}
+
+		loadClipMask(r10);
+		code.lea(r9, ptr[rbp + getOffset(core.display.data())]);
+		forEachPlane(r11d, r9, [&] {
+			if (simd == SimdLevel::SSE2) {
+				scrollPlaneSSE2((ScrollDir)inst.sub, pixels);
+				return;
+			}
+
+			code.mov(ecx, (HIRES_HEIGHT - 2) * rowBytes); // bottom two rows
+			Xbyak::Label loop;
+
+			switch ((ScrollDir)inst.sub) {
+			case ScrollDir::Down: {
+				const auto rowsMoved = HIRES_HEIGHT - pixels;
+				code.mov(edx, rowsMoved / 2);
+				code.L(loop);
+				code.vmovdqu(ymm0, yword[r9 + rcx - pixels * rowBytes]);
+				code.vpand(ymm0, ymm0, yword[r10 + rcx]);
+				code.vmovdqu(yword[r9 + rcx], ymm0);
+				code.sub(ecx, 32);
+				code.dec(edx);
+				code.jnz(loop);
+
+				if (rowsMoved & 1) { // top row moves on its own
+					code.vmovdqu(xmm0, xword[r9]);
+					code.vpand(xmm0, xmm0, xword[r10 + pixels * rowBytes]);
+					code.vmovdqu(xword[r9 + pixels * rowBytes], xmm0);
+				}
+
+				code.vpxor(xmm0, xmm0, xmm0); // rows scrolled in are blank
+				for (auto row = 0; row < pixels; row++) {
+					code.vmovdqu(xword[r9 + row * rowBytes], xmm0);
+				}
+				break;
+			}
+
+			case ScrollDir::Right:
+			case ScrollDir::Left:
+				code.L(loop);
+				code.vmovdqu(ymm0, yword[r9 + rcx]);
+				if ((ScrollDir)inst.sub == ScrollDir::Right) {
+					code.vpsllq(ymm1, ymm0, 64 - pixels); // pixels shifted out of the left words...
+					code.vpslldq(ymm1, ymm1, 8);          // ...go into the right words
+					code.vpsrlq(ymm0, ymm0, pixels);
+				} else {
+					code.vpsrlq(ymm1, ymm0, 64 - pixels); // pixels shifted out of the right words...
+					code.vpsrldq(ymm1, ymm1, 8);          // ...go into the left words
+					code.vpsllq(ymm0, ymm0, pixels);
+				}
+				code.vpor(ymm0, ymm0, ymm1);
+				code.vpand(ymm0, ymm0, yword[r10 + rcx]);
+				code.vmovdqu(yword[r9 + rcx], ymm0);
+				code.sub(ecx, 32);
+				code.jns(loop);
+				break;
+			}
+		});
+
+		upperDirty |= simd != SimdLevel::SSE2;
+	}
+
+	// Same as the AVX2 loops a row at a time. Rows and clip masks are 16 byte aligned, so pand can read the masks
+	void scrollPlaneSSE2(ScrollDir dir, int pixels) {
+		Xbyak::Label loop;
+		code.mov(ecx, (HIRES_HEIGHT - 1) * rowBytes); // bottom row
+
+		if (dir == ScrollDir::Down) {
+			code.mov(edx, HIRES_HEIGHT - pixels);
+			code.L(loop);
+			code.movdqu(xmm0, xword[r9 + rcx - pixels * rowBytes]);
+			code.pand(xmm0, xword[r10 + rcx]);
+			code.movdqu(xword[r9 + rcx], xmm0);
+			code.sub(ecx, rowBytes);
+			code.dec(edx);
+			code.jnz(loop);
+
+			code.pxor(xmm0, xmm0); // rows scrolled in are blank
+			for (auto row = 0; row < pixels; row++) {
+				code.movdqu(xword[r9 + row * rowBytes], xmm0);
+			}
+			return;
+		}
+
+		code.L(loop);
+		code.movdqu(xmm0, xword[r9 + rcx]);
+		code.movdqa(xmm1, xmm0);
+		if (dir == ScrollDir::Right) {
+			code.psllq(xmm1, 64 - pixels);
+			code.pslldq(xmm1, 8);
+			code.psrlq(xmm0, pixels);
+		} else {
+			code.psrlq(xmm1, 64 - pixels);
+			code.psrldq(xmm1, 8);
+			code.psllq(xmm0, pixels);
+		}
+		code.por(xmm0, xmm1);
+		code.pand(xmm0, xword[r10 + rcx]);
+		code.movdqu(xword[r9 + rcx], xmm0);
+		code.sub(ecx, rowBytes);
+		code.jns(loop);
+	}
+
+	// Terminators
+
+	void lowerTerminator(const IRInst& inst) {
+		const auto pc = word[rbp + getOffset(&core.pc)];
+
+		switch (inst.op) {
+		case IROp::Jump: //1nnn
+			info.beginEpilogue(code);
+			emitLinkedExit(inst.imm);
+			break;
+
+		case IROp::JumpV0: //Bnnn
+			code.movzx(ecx, readGpr(0));
+			code.add(ecx, inst.imm);
+			code.mov(pc, cx);
+			info.beginEpilogue(code);
+			beginExit();
+			emitTargetCache();
+			break;
+
+		case IROp::Call: { //2nnn
+			Xbyak::Label landing;
+			code.movzx(ecx, byte[rbp + getOffset(&core.sp)]); //load stack pointer
+			code.and_(ecx, (int)core.stack.size() - 1); // wraps like the interpreter's
+			code.mov(word[rbp + getOffset(core.stack.data()) + rcx * sizeof(uint16_t)], block.endPC);
+			code.inc(byte[rbp + getOffset(&core.sp)]);
+			emitPushReturn(landing);
+			info.beginEpilogue(code);
+			emitLinkedExit(inst.imm);
+
+			// 00EE lands here when it predicted us, with the budget already taken
+			code.L(landing);
+			code.test(r15d, r15d);
+			emitLink(block.endPC);
+			break;
+		}
+
+		case IROp::Return: { //00EE
+			Xbyak::Label mispredicted;
+			code.dec(byte[rbp + getOffset(&core.sp)]);
+			code.movzx(ecx, byte[rbp + getOffset(&core.sp)]); //load stack pointer
+			code.and_(ecx, (int)core.stack.size() - 1);
+			code.movzx(edx, word[rbp + getOffset(core.stack.data()) + rcx * sizeof(uint16_t)]);
+			info.beginEpilogue(code);
+			beginExit();
+			emitPopReturn(mispredicted);
+
+			code.L(mispredicted);
+			code.mov(pc, dx);
+			code.jmp(exitRW());
+			break;
+		}
+
+		case IROp::Skip:
+			lowerSkip(inst);
+			break;
+
+		case IROp::WaitKey: { //Fx0A
+			Xbyak::Label noKey;
+			const auto loadedBefore = loaded;
+			const auto dirtyBefore = dirty;
+
+			code.movzx(eax, word[rbp + getOffset(&core.keyState)]); // load key bitmask
+			code.bsf(eax, eax); // index of lowest held key, zf set if none are held
+			code.jz(noKey, Xbyak::CodeGenerator::T_NEAR);
+			code.mov(writeGpr(inst.x), al);
+			info.beginEpilogue(code);
+			emitLinkedExit(block.endPC);
+
+			code.L(noKey); // stay on this instruction until a key is held
+			loaded = loadedBefore;
+			dirty = dirtyBefore;
+			emitLinkedExit(block.endPC - 2);
+			break;
+		}
+
+		case IROp::FallThrough:
+			info.beginEpilogue(code);
+			emitLinkedExit(block.endPC);
+			break;
+
+		case IROp::Invalid:
+			code.mov(pc, block.endPC - 2);
+			writeBack();
+			code.mov(abiParam1, rbp);
+			code.mov(abiParam2.cvt32(), inst.imm);
+			callHelper((const void*)&invalidInstruction);
+			info.beginEpilogue(code);
+			emitDispatcherExit();
+			break;
+
+		default:
+			printf("Can't lower IR op %d\n", (int)inst.op);
+			exit(1);
+		}
+	}
+
+	// Push this block's return pc and landing stub on the return stack
+	void emitPushReturn(Xbyak::Label& landing) {
+		// rax: new top
+		// rcx: landing stub
+		// r8: pointer to the return stack
+		code.mov(r8, (uintptr_t)&ctx.returnStack);
+		code.mov(eax, dword[r8 + offsetof(ReturnStack, top)]);
+		code.inc(eax);
+		code.and_(eax, ReturnStack::size - 1);
+		code.mov(dword[r8 + offsetof(ReturnStack, top)], eax);
+		code.shl(eax, 4);
+		code.lea(rcx, ptr[rip + landing]);
+		code.mov(dword[r8 + rax + offsetof(ReturnStack, entries) + offsetof(ReturnStack::Entry, guestPC)], block.endPC);
+		code.mov(qword[r8 + rax + offsetof(ReturnStack, entries) + offsetof(ReturnStack::Entry, host)], rcx);
+	}
+
+	// Pop the return stack and jump to the landing stub if it predicted edx, the pc we're returning to
+	void emitPopReturn(Xbyak::Label& mispredicted) {
+		// rax: top
+		// r8: pointer to the return stack
+		// r9: new top
+		code.mov(r8, (uintptr_t)&ctx.returnStack);
+		code.mov(eax, dword[r8 + offsetof(ReturnStack, top)]);
+		code.lea(r9d, ptr[eax - 1]);
+		code.and_(r9d, ReturnStack::size - 1);
+		code.mov(dword[r8 + offsetof(ReturnStack, top)], r9d);
+		code.shl(eax, 4);
+		code.cmp(dword[r8 + rax + offsetof(ReturnStack, entries) + offsetof(ReturnStack::Entry, guestPC)], edx);
+		code.jne(mispredicted);
+		code.jmp(qword[r8 + rax + offsetof(ReturnStack, entries) + offsetof(ReturnStack::Entry, host)]);
+	}
+
+	// Jump to the block at ecx through this site's inline cache, expects flags from the budget
+	void emitTargetCache() {
+		Xbyak::Label toDispatcher;
+		auto& cache = ctx.targetCaches.emplace_back();
+
+		code.jle(toDispatcher, Xbyak::CodeGenerator::T_NEAR); // out of budget
+
+		for (auto& entry : cache.entries) {
+			Xbyak::Label nextEntry;
+			code.cmp(ecx, 0x7fffffff); // never matches, forces an imm32 to patch
+			entry.compare = (uint8_t*)code.getCurr() - 4;
+			code.jne(nextEntry);
+			code.jmp(nextEntry, Xbyak::CodeGenerator::T_NEAR); // patched by fillTargetCache
+			entry.jump = (uint8_t*)code.getCurr() - 4;
+			code.L(nextEntry);
+		}
+
+		// Miss, pc's already stored for the compile stub
+		code.mov(abiParam3.cvt32(), ecx); // first, abiParam1 is rcx on Windows
+		code.mov(abiParam1, (uintptr_t)&ctx);
+		code.mov(abiParam2, (uintptr_t)&cache);
+		callHelper((const void*)&fillTargetCache);
+		code.jmp(rax);
+
+		code.L(toDispatcher);
+		code.jmp(exitRW());
+	}
+
+	void lowerSkip(const IRInst& inst) { //3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1
+		Xbyak::Label skip;
+
+		const auto cond = (Cond)inst.sub;
+		switch (cond) {
+		case Cond::EqImm:
+		case Cond::NeImm:
+			code.cmp(readGpr(inst.x), inst.imm);
+			break;
+
+		case Cond::EqReg:
+		case Cond::NeReg: {
+			const auto& vx = readGpr(inst.x);
+			code.cmp(vx, source(vx, inst.y));
+			break;
+		}
+
+		case Cond::KeyDown:
+		case Cond::KeyUp:
+			code.movzx(ecx, readGpr(inst.x));
+			code.movzx(eax, word[rbp + getOffset(&core.keyState)]); // load key bitmask
+			code.bt(ax, cx); // 16 bit bt takes the key index mod 16
+			break;
+		}
+
+		switch (cond) {
+		case Cond::EqImm:
+		case Cond::EqReg:   code.je(skip, Xbyak::CodeGenerator::T_NEAR);  break; // skip if equal
+		case Cond::NeImm:
+		case Cond::NeReg:   code.jne(skip, Xbyak::CodeGenerator::T_NEAR); break; // skip if not equal
+		case Cond::KeyDown: code.jc(skip, Xbyak::CodeGenerator::T_NEAR);  break; // skip if key is held
+		case Cond::KeyUp:   code.jnc(skip, Xbyak::CodeGenerator::T_NEAR); break; // skip if key isn't held
+		}
+
+		info.beginEpilogue(code);
+		emitLinkedExit(block.endPC);
+		code.L(skip);
+		emitLinkedExit(block.skipPC); // skip next instruction
+	}
+};